@@ -1,22 +1,42 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE // accept4
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
 #include <pthread.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
 
 // Some definitions
-#define QUEUE_SIZE 8 //represents a maximum size of requests to attempt to queue for listening before rejecting any further requests
+#define QUEUE_SIZE 128 //represents a maximum size of requests to attempt to queue for listening before rejecting any further requests
 #define BUFSIZE 1024
 #define HOSTSIZE 100
 #define PORTSIZE 10
+#define FRAMESIZE (4 + 1 + 3 + 1 + 255) // Longest possible message: type, bar, 3 digit size, bar and at most 255 bytes of fields
+#define CONN_BUDGET 1024 // Most memory an idle connection may cost, checked by --memtest
+#define OUTBOX_SIZE 4096 // Most bytes queued for a client that isn't reading, it is disconnected past that
+#define MAXCONNECTIONS 100000 // Most connections open at once, lowered to fit the fd limit
+#define RATE_PER_IP 20 // Connections per second one source address may open once it has used up...
+#define BURST_PER_IP 40 // ...a burst of this many
 
 // Message parsing error handlers, valid for an ok field/message
 typedef enum {
@@ -29,16 +49,22 @@ typedef enum {
 } msg_type;
 
 // Temp signal handlers
-volatile int active = 1;
+// Atomic since --flood runs the accept loop on a thread of its own, atomic_int is lock free so the handler can still set it
+volatile atomic_int active = 1;
 
-// Checks if game is going on
-volatile int active_game = 0;
+// Set by SIGUSR1, main prints the admission counters when it sees it
+volatile atomic_int reportRequested = 0;
 
 void handler(int signum)
 {
     active = 0;
 }
 
+void report_handler(int signum)
+{
+    reportRequested = 1;
+}
+
 // Set up signal handlers for primary thread
 // Return a mask blocking those signals for worker threads
 // FIXME should check whether any of these actually succeeded
@@ -52,73 +78,30 @@ void install_handlers(sigset_t *mask)
     sigaction(SIGINT, &act, NULL);
     sigaction(SIGTERM, &act, NULL);
 
+    act.sa_handler = report_handler;
+    sigaction(SIGUSR1, &act, NULL);
+
+    // Writing to an opponent who just hung up should fail with EPIPE, not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
     sigemptyset(mask);
     sigaddset(mask, SIGINT);
     sigaddset(mask, SIGTERM);
+    sigaddset(mask, SIGUSR1);
 }
 
-// Data to be sent to worker threads
-struct connection_data {
-    struct sockaddr_storage addr;
-    socklen_t addr_len;
+// Per-connection state, kept small since it is all an idle connection costs apart from its half of a game
+// The peer address is only logged when the connection is accepted, not kept
+struct connection {
     int fd;
+    uint16_t pending; // Bytes of a partial message held in buf
+    uint8_t side; // SIDE_X for the first connection of a game, SIDE_O for the second
+    struct game* game; // Game this connection was paired into by main
+    char* buf; // FRAMESIZE bytes, only allocated while a partial message is pending
+    struct connection* prev; // Neighbours in the owning reactor's list (next also links main's hand-over stack)
+    struct connection* next;
 };
 
-// Server stucture to keep track of concurrent games (multithreaded approach), simple linked list with "game" nodes
-// FIXME implement locks
-typedef struct {
-    struct game* first; // Reference to first game to maintain linked list structure
-    int gameCount; // How many games the server has setup
-} server;
-
-// "game" node structure that contains a game ID, 2 players in each game, board state, and which player's turn it is
-struct game{
-    int gameID; // based on gameCount of server
-    char playerOne[256]; // Player 1's name
-    int fd1; // Player 1's connection socket file descriptor
-    char playerTwo[256]; // Player 2 name
-    int fd2; // Player 2's connection socket file descriptor
-    const char* board; // Tic-Tac-Toe game board
-    int turn; // Odd means player 1, even means player 2
-
-    struct game* next; // Reference to the next game (if any) to maintain linked list structure
-};
-
-// Sets up game server using server structure
-server* createGameServer() {
-    server *gameServer = malloc(sizeof(server));
-    gameServer->first = NULL;
-    gameServer->gameCount = 0;
-    return gameServer;
-}
-
-// Sets up a game instance using the game struct
-void newGame(server* gameServer) {
-    struct game* match = malloc(sizeof(struct game));
-
-    // Some struct parameter initializers
-    match->gameID = gameServer->gameCount;
-    match->board = ".........";
-    match->turn = 1;
-    match->next = NULL;
-
-    if (gameServer->first == NULL) { // First game in the server
-        gameServer->first = match;
-        gameServer->gameCount++;
-    }
-    else { // Iterate through list of games to place the most recent match at the end
-        struct game *ptr = gameServer->first;
-        while (ptr->next != NULL)
-        {
-            ptr = ptr->next;
-        }
-        ptr->next = match;
-        gameServer->gameCount++;
-    }
-
-    return;
-}
-
 // Message parser
 int tokenize(char* buf, char** tokens) {
     char* ptr;
@@ -166,7 +149,7 @@ msg_type checkType(char* type) {
 // Sets the maximum amount of bars to be parsed based on message type
 // Only useful for some types but can work with all valid types
 int setMaxBars(msg_type type) {
-    if (type == PLAY) return 3;
+    if (type == PLAY) return 4; // PLAY|size|name|variant| where the variant field is optional
     else if (type == WAIT) return 2;
     else if (type == BEGN) return 4;
     else if (type == MOVE) return 4;
@@ -178,7 +161,31 @@ int setMaxBars(msg_type type) {
     else return -1;
 }
 
-// Message field error checker
+// Sets the minimum amount of bars, only differs from the maximum for messages with optional fields
+int setMinBars(msg_type type) {
+    if (type == PLAY) return 3;
+    else return setMaxBars(type);
+}
+
+// Finds where the first message in buf ends from just its type and size, so several messages read at once can be split
+// up and a partial one held back. Returns the message length, 0 if more bytes are needed, -1 if it can't be a message.
+int frameLength(const char* buf, int len) {
+    if (len < 5) return 0;
+    if (buf[4] != '|') return -1;
+
+    int size = 0, i = 5;
+    for (; i < len && buf[i] != '|'; i++) {
+        if (buf[i] < '0' || buf[i] > '9' || i - 5 >= 3) return -1;
+        size = size * 10 + buf[i] - '0';
+    }
+    if (i == len) return 0;
+    if (i == 5 || size > 255) return -1;
+
+    int total = i + 1 + size;
+    return (len >= total) ? total : 0;
+}
+
+// Message field error checker, what is wrong is also written to fd unless it is -1
 msg_err parsePacket(char* buf, int fd)
 {
     // No need to check for empty buffer, already done by call to read
@@ -213,12 +220,13 @@ msg_err parsePacket(char* buf, int fd)
     type = checkType(msgtype);
     if (type == INVLTYPE) {
         printf("Invalid message type!\n");
-        write(fd, "Invalid message type!\n", 23);
+        if (fd >= 0) write(fd, "Invalid message type!\n", 23);
         return INVLFORM;
     }
 
-    // Set max bar amount based on message type read
+    // Set max and min bar amount based on message type read
     int maxBars = setMaxBars(type);
+    int minBars = setMinBars(type);
 
     // Checking size field
     if (*ptr != '\0' && *ptr == '|') {
@@ -231,7 +239,7 @@ msg_err parsePacket(char* buf, int fd)
     }
     else {
         printf("Invalid bar placement!\n");
-        write(fd, "Invalid bar placement!\n", 24);
+        if (fd >= 0) write(fd, "Invalid bar placement!\n", 24);
         return BARPLCMENT;
     }
 
@@ -247,7 +255,7 @@ msg_err parsePacket(char* buf, int fd)
             }
             else {
                 printf("Invalid size2!\n");
-                write(fd, "Invalid size!\n", 15);
+                if (fd >= 0) write(fd, "Invalid size!\n", 15);
                 return INVLSIZE;
             }
         }
@@ -267,7 +275,7 @@ msg_err parsePacket(char* buf, int fd)
     }
     else {
         printf("Invalid bar placement1!\n");
-        write(fd, "Invalid bar placement1!\n", 24);
+        if (fd >= 0) write(fd, "Invalid bar placement1!\n", 24);
         return BARPLCMENT;
     }
 
@@ -278,7 +286,7 @@ msg_err parsePacket(char* buf, int fd)
     if (numerSize == 0 && (type == WAIT || type == RSGN)) return VALID;
     else if (numerSize == 0) {
         printf("Invalid size3!\n");
-        write(fd, "Invalid size!\n", 15);
+        if (fd >= 0) write(fd, "Invalid size!\n", 15);
         return INVLSIZE;
     }
 
@@ -287,14 +295,14 @@ msg_err parsePacket(char* buf, int fd)
         if (*ptr != '\0' && *ptr == '|') { // Found a bar in the message
             if (actualSize < numerSize && barsRead == maxBars) { // Check for if we found a bar too early
                 printf("Field size mismatch!\n");
-                write(fd, "Field size mismatch!\n", 22);
+                if (fd >= 0) write(fd, "Field size mismatch!\n", 22);
                 return NEBYTE;
             }
             barsRead++;
             if (barsRead > maxBars) // Checks if too many bars are present in the message
             {
                 printf("Too many bars present!\n");
-                write(fd, "Too many bars present!\n", 24);
+                if (fd >= 0) write(fd, "Too many bars present!\n", 24);
                 return INVLFORM;
             }
             ptr++;
@@ -304,17 +312,17 @@ msg_err parsePacket(char* buf, int fd)
         }
         else if (*ptr == '\0' && actualSize < numerSize && barsRead == maxBars) {
             printf("Field size mismatch!\n");
-            write(fd, "Field size mismatch!\n", 22);
+            if (fd >= 0) write(fd, "Field size mismatch!\n", 22);
             return NEBYTE;
         }
-        else if (*ptr == '\0' && actualSize == numerSize && barsRead < maxBars) {
+        else if (*ptr == '\0' && actualSize == numerSize && barsRead < minBars) {
             printf("Not enough bars!\n");
-            write(fd, "Not enough bars!\n", 18);
+            if (fd >= 0) write(fd, "Not enough bars!\n", 18);
             return NEBAR;
         }
-        else if (*ptr == '\0' && actualSize == numerSize-1 && barsRead == maxBars-1) {
+        else if (*ptr == '\0' && actualSize == numerSize-1 && barsRead == minBars-1) {
             printf("Missing ending bar!\n");
-            write(fd, "Missing ending bar!\n", 21);
+            if (fd >= 0) write(fd, "Missing ending bar!\n", 21);
             return NEBAR;
         }
         else if (*ptr == '\0' && actualSize < numerSize && barsRead < maxBars) {
@@ -325,363 +333,2142 @@ msg_err parsePacket(char* buf, int fd)
 
     if (*ptr != '\0') { // Message is longer than indicated
         printf("Field size mismatch!\n");
-        write(fd, "Field size mismatch!\n", 22);
+        if (fd >= 0) write(fd, "Field size mismatch!\n", 22);
         return INVLFORM;
     }
 
     return VALID;
 }
 
-char* createBoard(char* board) {
-    board = "........."; //char* board = malloc(9 * sizeof(char));
-    //memset(board, '.', 9); //char 46 is '.'
-    return board;
-}
-void printBoard(char* board) {
-    for (int i = 0; i < 9; i++) { //could also just print %s tbh
-        printf("%c", board[i]);
-    }
+// Board variants: an N x N board where K marks in a row (any direction) wins
+// Common sizes get a bitboard kernel specialized at compile time, anything else uses the generic checker
+#define MAXSIDE 15 // Largest supported board side (gomoku)
+#define MAXCELLS (MAXSIDE * MAXSIDE)
+#define BITBOARD_SIDE 8 // Largest side whose cells fit in a uint64_t
+
+// Results of placing a mark on the board
+typedef enum {
+    MV_INVALID = -1, MV_OK, MV_WIN, MV_DRAW
+} move_result;
+
+// Win checker given the mover's bitboard and the cell just played, returns 1 if that cell completed a line
+typedef int (*win_kernel)(uint64_t bits, int cell);
+
+struct variant {
+    const char* name; // NULL for variants given as "N,K" in PLAY
+    int side; // Board is side x side
+    int k; // Marks in a row needed to win
+    win_kernel kernel; // NULL means use the generic checker
+};
+
+// Board state for a single game of any variant
+// The cells go last so that on small boards everything a move touches shares the first couple of cache lines
+struct board_state {
+    struct variant variant;
+    uint64_t bits[2]; // Bitboards for X and O, only kept up to date when the variant has a kernel
+    int moves; // Marks placed so far
+    char cells[MAXCELLS + 1]; // '.', 'X' or 'O' for every cell in row-major order, NUL terminated so it can be sent in MOVD
+};
+
+// Row/column steps for the four line directions: horizontal, vertical, diagonal, anti-diagonal
+static const int dir_row[4] = {0, 1, 1, 1};
+static const int dir_col[4] = {1, 0, 1, -1};
+
+// Specialized kernel for a side x side board needing k in a row
+// starts[d][cell] holds the cells a run in direction d could start from and still pass through cell, so only the lines through the
+// last move are checked. Starts are limited to cells where the whole run fits on the board, so shifting never wraps across a row.
+#define DEFINE_BITBOARD_KERNEL(side, k) \
+static uint64_t starts_##side##_##k[4][side * side]; \
+static void init_kernel_##side##_##k(void) { \
+    for (int cell = 0; cell < side * side; cell++) { \
+        for (int d = 0; d < 4; d++) { \
+            uint64_t starts = 0; \
+            for (int j = 0; j < k; j++) { \
+                int r = cell / side - j * dir_row[d], c = cell % side - j * dir_col[d]; \
+                int last_r = r + (k - 1) * dir_row[d], last_c = c + (k - 1) * dir_col[d]; \
+                if (r < 0 || c < 0 || c >= side || last_r >= side || last_c < 0 || last_c >= side) continue; \
+                starts |= 1ULL << (r * side + c); \
+            } \
+            starts_##side##_##k[d][cell] = starts; \
+        } \
+    } \
+} \
+static int win_kernel_##side##_##k(uint64_t bits, int cell) { \
+    uint64_t run; \
+    run = bits & starts_##side##_##k[0][cell]; \
+    for (int i = 1; i < k; i++) run &= bits >> i; \
+    if (run) return 1; \
+    run = bits & starts_##side##_##k[1][cell]; \
+    for (int i = 1; i < k; i++) run &= bits >> (i * side); \
+    if (run) return 1; \
+    run = bits & starts_##side##_##k[2][cell]; \
+    for (int i = 1; i < k; i++) run &= bits >> (i * (side + 1)); \
+    if (run) return 1; \
+    run = bits & starts_##side##_##k[3][cell]; \
+    for (int i = 1; i < k; i++) run &= bits >> (i * (side - 1)); \
+    return run != 0; \
 }
 
-int check_position(char* board, char* position) {
-    int board_index;
-    if (strcmp(position, "1,1") == 0) board_index = 0;
-    else if (strcmp(position, "1,2") == 0) board_index = 1;
-    else if (strcmp(position, "1,3") == 0) board_index = 2;
-    else if (strcmp(position, "2,1") == 0) board_index = 3;
-    else if (strcmp(position, "2,2") == 0) board_index = 4;
-    else if (strcmp(position, "2,3") == 0) board_index = 5;
-    else if (strcmp(position, "3,1") == 0) board_index = 6;
-    else if (strcmp(position, "3,2") == 0) board_index = 7;
-    else if (strcmp(position, "3,3") == 0) board_index = 8;
-    else return -1;
+// Sizes that get a specialized kernel, as (side, k) pairs with side <= BITBOARD_SIDE
+#define KERNEL_SIZES(X) X(3, 3) X(4, 3) X(4, 4) X(5, 4) X(5, 5) X(6, 5) X(7, 5) X(8, 5)
+
+KERNEL_SIZES(DEFINE_BITBOARD_KERNEL)
+
+#define KERNEL_ENTRY(side, k) {NULL, side, k, win_kernel_##side##_##k},
+static const struct variant kernels[] = { KERNEL_SIZES(KERNEL_ENTRY) };
 
-    if (board[board_index] == 'X' || board[board_index] == 'O') return -1;
-    else return board_index; // board[board_index] == '.';
+// Fills in the start tables for every kernel, must run before any game starts
+#define KERNEL_INIT(side, k) init_kernel_##side##_##k();
+void init_kernels(void) {
+    KERNEL_SIZES(KERNEL_INIT)
 }
 
-int make_move(char* board, char* position, char* role) {
-    int board_index = check_position(board, position);
-    if (board_index == -1) return -1; //INVL MOVE
-    else {
-        board[board_index] = role[0];
-        return 0;
-    }
+// Variants that can be requested by name in PLAY
+static const struct variant variants[] = {
+    {"3x3", 3, 3, NULL},
+    {"4x4", 4, 4, NULL},
+    {"5x5", 5, 4, NULL},
+    {"gomoku", 15, 5, NULL},
+};
+#define NVARIANTS (int)(sizeof(variants) / sizeof(variants[0]))
+#define NKERNELS (int)(sizeof(kernels) / sizeof(kernels[0]))
 
+// Returns the specialized kernel for a board size, or NULL if it only has the generic checker
+win_kernel find_kernel(int side, int k) {
+    for (int i = 0; i < NKERNELS; i++) {
+        if (kernels[i].side == side && kernels[i].k == k) return kernels[i].kernel;
+    }
+    return NULL;
 }
 
-// Method for reading data from a client (threaded approach)
-void *read_data(void *arg)
-{
-    struct connection_data *con = arg;
-    char buf[BUFSIZE], host[HOSTSIZE], port[PORTSIZE];
-    int bytes, error;
+// Fills in a variant from a PLAY field, either a variant name or "N,K"
+// An empty field gives the classic 3x3 game, returns -1 for anything unsupported
+int variant_lookup(const char* spec, struct variant* out) {
+    if (spec == NULL || spec[0] == '\0') spec = variants[0].name;
 
-    error = getnameinfo((struct sockaddr *)&con->addr, con->addr_len, host, HOSTSIZE, port, PORTSIZE, NI_NUMERICSERV);
-    if (error) {
-        fprintf(stderr, "getnameinfo: %s\n", gai_strerror(error));
-        strcpy(host, "??");
-        strcpy(port, "??");
+    for (int i = 0; i < NVARIANTS; i++) {
+        if (strcmp(spec, variants[i].name) == 0) {
+            *out = variants[i];
+            out->kernel = find_kernel(out->side, out->k);
+            return 0;
+        }
     }
 
-    printf("Connection from %s:%s\n", host, port);
-    char* board = ".........";
+    char* end;
+    long side = strtol(spec, &end, 10);
+    if (end == spec || *end != ',') return -1;
+    char* kstr = end + 1;
+    long k = strtol(kstr, &end, 10);
+    if (end == kstr || *end != '\0') return -1;
+    if (side < 3 || side > MAXSIDE || k < 3 || k > side) return -1;
+
+    out->name = NULL;
+    out->side = side;
+    out->k = k;
+    out->kernel = find_kernel(side, k);
+    return 0;
+}
 
-    while (active && (bytes = read(con->fd, buf, BUFSIZE)) > 0) {
-        buf[bytes] = '\0';
+void board_init(struct board_state* board, const struct variant* variant) {
+    int cells = variant->side * variant->side;
+    board->variant = *variant;
+    memset(board->cells, '.', cells);
+    board->cells[cells] = '\0';
+    board->bits[0] = board->bits[1] = 0;
+    board->moves = 0;
+}
 
-        printf("[%s:%s] read %d bytes |%s|\n", host, port, bytes, buf);
-        
-        // Packet and field error checking
-        msg_err errStat = parsePacket(buf, con->fd);
-        int bufLoc = 0;
-        bufLoc += bytes;
-
-        if (errStat != VALID) { // We have an invalid message
-            if (errStat == INCMPL) { // Incomplete message received, must read more from client
-                int bytes2;
-                while (active && errStat == INCMPL && (bytes2 = read(con->fd, &buf[bufLoc], BUFSIZE)) > 0) {
-                    errStat = parsePacket(buf, con->fd);
-                    bufLoc += bytes2;
-                }
+// Generic checker for any size, walks the char board outward from the cell just played
+int generic_win(const struct board_state* board, int cell) {
+    int side = board->variant.side, k = board->variant.k;
+    int row = cell / side, col = cell % side;
+    char mark = board->cells[cell];
+
+    for (int d = 0; d < 4; d++) {
+        int run = 1;
+        for (int sign = -1; sign <= 1; sign += 2) {
+            int r = row + sign * dir_row[d], c = col + sign * dir_col[d];
+            while (r >= 0 && r < side && c >= 0 && c < side && board->cells[r * side + c] == mark) {
+                run++;
+                r += sign * dir_row[d];
+                c += sign * dir_col[d];
             }
-            else {
-                printf("Message is malformed! Ending connection now\n");
-                write(con->fd, "Message is malformed! Ending connection now\n", 45);
-                break;
+        }
+        if (run >= k) return 1;
+    }
+    return 0;
+}
+
+// Slow checker that scans the whole board for a line of mark, used to cross-check the incremental checkers
+int board_has_line(const struct board_state* board, char mark) {
+    int side = board->variant.side, k = board->variant.k;
+
+    for (int cell = 0; cell < side * side; cell++) {
+        if (board->cells[cell] != mark) continue;
+        for (int d = 0; d < 4; d++) {
+            int run = 1, r = cell / side + dir_row[d], c = cell % side + dir_col[d];
+            while (run < k && r < side && c >= 0 && c < side && board->cells[r * side + c] == mark) {
+                run++;
+                r += dir_row[d];
+                c += dir_col[d];
             }
+            if (run == k) return 1;
         }
+    }
+    return 0;
+}
+
+void printBoard(const struct board_state* board) {
+    int side = board->variant.side;
+    for (int r = 0; r < side; r++) {
+        printf("%.*s\n", side, &board->cells[r * side]);
+    }
+}
+
+// Turns an "r,c" position (1-based) into a free cell index, -1 if off the board or occupied
+int check_position(const struct board_state* board, const char* position) {
+    int side = board->variant.side;
+    char* end;
+
+    long row = strtol(position, &end, 10);
+    if (end == position || *end != ',') return -1;
+    const char* colstr = end + 1;
+    long col = strtol(colstr, &end, 10);
+    if (end == colstr || *end != '\0') return -1;
+    if (row < 1 || row > side || col < 1 || col > side) return -1;
+
+    int board_index = (row - 1) * side + (col - 1);
+    if (board->cells[board_index] != '.') return -1;
+    else return board_index;
+}
+
+// Places a mark on a free cell and checks only the lines through it
+move_result place_mark(struct board_state* board, int cell, char mark) {
+    board->cells[cell] = mark;
+    board->moves++;
+
+    int won;
+    if (board->variant.kernel != NULL) {
+        uint64_t* bits = &board->bits[mark == 'O'];
+        *bits |= 1ULL << cell;
+        won = board->variant.kernel(*bits, cell);
+    }
+    else won = generic_win(board, cell);
+
+    if (won) return MV_WIN;
+    if (board->moves == board->variant.side * board->variant.side) return MV_DRAW;
+    return MV_OK;
+}
+
+// Takes back the last mark placed on a cell
+void remove_mark(struct board_state* board, int cell) {
+    if (board->variant.kernel != NULL) board->bits[board->cells[cell] == 'O'] &= ~(1ULL << cell);
+    board->cells[cell] = '.';
+    board->moves--;
+}
+
+move_result make_move(struct board_state* board, const char* position, const char* role) {
+    if ((role[0] != 'X' && role[0] != 'O') || role[1] != '\0') return MV_INVALID;
+    int board_index = check_position(board, position);
+    if (board_index == -1) return MV_INVALID; //INVL MOVE
+    return place_mark(board, board_index, role[0]);
+}
 
-        // FIXME make sure we do not grab more than 1 message!!!!!!!!
+// Small xorshift generator so benchmarks and bots don't share rand()'s hidden state
+static inline uint64_t xorshift64(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
 
-        // Parse message
-        char** tokens = malloc(sizeof(char*) * 5); //MAX FIELDS
-        memset(tokens, (char) 0, 5);
-        for (int i = 0; i < 5; i++) {
-            tokens[i] = malloc(sizeof(char) * 256); //MAX FIELD SIZE
-            memset(tokens[i], (char) 0, 256);
+// Plays random games until at least `moves` marks are placed, returns moves/sec
+double bench_variant(const struct variant* variant, long moves) {
+    struct board_state board;
+    int free_cells[MAXCELLS];
+    uint64_t rng = 0x9E3779B97F4A7C15ULL;
+    long played = 0;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (played < moves) {
+        int cells = variant->side * variant->side;
+        board_init(&board, variant);
+        for (int i = 0; i < cells; i++) free_cells[i] = i;
+
+        move_result result = MV_OK;
+        for (int left = cells; result == MV_OK; left--) {
+            int pick = xorshift64(&rng) % left;
+            int cell = free_cells[pick];
+            free_cells[pick] = free_cells[left - 1];
+            result = place_mark(&board, cell, (board.moves & 1) ? 'O' : 'X');
+            played++;
         }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return played / secs;
+}
 
-        int tokerror = tokenize(buf, tokens);
-        if (tokerror != 0) {//error has occured tokenizing
-            printf("Error occured while tokenizing!\n"); // FIXME more specific error checking
+// ttts --bench [moves]: moves/sec for every named variant, with and without its specialized kernel
+int bench_variants(long moves) {
+    printf("%-8s %5s %3s %-8s %14s\n", "variant", "side", "k", "checker", "moves/sec");
+    for (int i = 0; i < NVARIANTS; i++) {
+        struct variant variant;
+        variant_lookup(variants[i].name, &variant);
+
+        if (variant.kernel != NULL) {
+            printf("%-8s %5d %3d %-8s %14.0f\n", variant.name, variant.side, variant.k, "kernel", bench_variant(&variant, moves));
         }
-        else {
-            printf("First Token: %s\n", tokens[0]);
-            //if (first token is PLAY, MOVE, RSGN, or DRAW) //Make methods for each of these that do their proper function and returns -1 if unsuccessful or invalid
-            int draw_match = 0;
+        variant.kernel = NULL;
+        printf("%-8s %5d %3d %-8s %14.0f\n", variant.name, variant.side, variant.k, "generic", bench_variant(&variant, moves));
+    }
+    return EXIT_SUCCESS;
+}
 
-            if(checkType(tokens[0]) == PLAY) {
+// Per-game state machine. Everything about whose move it is lives in one atomic word, and every transition is a
+// compare-and-swap on it, so both players' handlers can act on the same game without a mutex.
+//   WAITING -> X_TO_MOVE once both players sent PLAY
+//   X_TO_MOVE <-> O_TO_MOVE on each move, -> DRAW_OFFERED on DRAW|S, -> OVER on a line, a full board or RSGN
+//   DRAW_OFFERED -> back to the offerer's move on DRAW|R, -> OVER on DRAW|A or RSGN
+// Only the player to move ever writes the board. A move places the mark first and then swaps the state, taking the mark
+// back off if the swap lost to the opponent resigning, so the opponent never sees a half made move.
+typedef enum {
+    GS_WAITING, GS_X_TO_MOVE, GS_O_TO_MOVE, GS_DRAW_OFFERED, GS_OVER
+} game_phase;
 
-                // FIXME for
-                printf("Player Name: %s\n", tokens[2]); ///CHECK IF NAME IS TAKEN
-                //board = createBoard();
-                active_game = 1;
+typedef enum {
+    OUT_NONE, OUT_X_WINS, OUT_O_WINS, OUT_DRAW
+} game_outcome;
 
-                //put in play check
+// Answers from the state machine, the handler turns these into protocol messages
+typedef enum {
+    GR_OK, GR_BEGIN, GR_WIN, GR_DRAW, GR_ABANDONED, GR_INVALID, GR_NOT_TURN, GR_NO_DRAW, GR_OVER
+} game_result;
+
+#define SIDE_X 0
+#define SIDE_O 1
+#define SIDE_MARK(side) ((side) == SIDE_X ? 'X' : 'O')
+
+// State word: phase in bits 0-2, player who offered a draw in bit 3, players joined in bits 4-5, outcome in bits 6-7,
+// and a count of transitions in the rest so a swap can never succeed against a stale copy of the same phase
+#define GS_PHASE(s) ((s) & 7)
+#define GS_OFFERER(s) (((s) >> 3) & 1)
+#define GS_JOINED(s) (((s) >> 4) & 3)
+#define GS_OUTCOME(s) (((s) >> 6) & 3)
+#define GS_SEQ(s) ((s) >> 8)
+#define GS_MAKE(phase, offerer, joined, outcome, seq) \
+    ((uint32_t)(phase) | ((uint32_t)(offerer) << 3) | ((uint32_t)(joined) << 4) | ((uint32_t)(outcome) << 6) | ((uint32_t)(seq) << 8))
+#define GS_TO_MOVE(side) ((side) == SIDE_X ? GS_X_TO_MOVE : GS_O_TO_MOVE)
+
+// Memory held on behalf of connections and games (connection structs, games, pending receive buffers), so the cost of a
+// connection can be measured instead of guessed, see --memtest
+_Atomic long trackedBytes = 0;
+
+// Over-aligned sizes must be a multiple of align, as for aligned_alloc
+void* tracked_alloc(size_t align, size_t size) {
+    void* ptr = (align > _Alignof(max_align_t)) ? aligned_alloc(align, size) : malloc(size);
+    if (ptr != NULL) atomic_fetch_add_explicit(&trackedBytes, size, memory_order_relaxed);
+    return ptr;
+}
 
-            }
-            else if(checkType(tokens[0]) == MOVE) {
-                // This now assumes that there is an active game between 2 players
-                // FIXME first grab player information from synchronized structures:
-                   // playerOne, p1length, fd1, playerTwo, p2length, fd2, etc.
+void tracked_free(void* ptr, size_t size) {
+    atomic_fetch_sub_explicit(&trackedBytes, size, memory_order_relaxed);
+    free(ptr);
+}
 
-                // MASSIVE FIXME!!!!!!!!!!!!!!!!!!!!!!!! DO NOT USE CON FD IN FINAL, USE SPECIFIC PLAYER DESCRIPTORS!!!!!!!!!!!!!//////////////////////////
+// Player names are interned in one table shared by every game, so a game only holds two pointers and a name that is
+// in several games at once is stored once. Each name counts the games holding it and is freed with the last of them.
+// Only PLAY and the end of a game touch the table, so a plain mutex is enough.
+struct name {
+    int refs; // Games holding the name, under names.lock
+    char text[]; // What intern hands out
+};
 
-                if (make_move(board, tokens[3], tokens[2]) == -1) {
-                    printf("INVL|24|That space is occupied.|\n");  
-                    write(con->fd, "INVL|24|That space is occupied.|", 33); 
-                    write(con->fd, "\n", 2);
-                }
-                else {
-                    printf("MOVD|16|%s|%s|%s|\n", tokens[2], tokens[3], board); // FIXME PRINTF TO OTHER CLIENT
-                    //write(con->fd, "MOVD|16|%s|%s|%s|", tokens[2], tokens[3], board); THIS DOESN"T WORK, LOOK UNDER THIS FOR THE WORKING VERSION
-                    
-                    // this is to write back to the client that their move was successful
-                    write(con->fd, "MOVD|16|", 9);
-                    write(con->fd, tokens[2], strlen(tokens[2]));
-                    write(con->fd, "|", 2);
-                    write(con->fd, tokens[3], strlen(tokens[3]));
-                    write(con->fd, "|", 2); 
-                    write(con->fd, tokens[2], strlen(board)); 
-                    write(con->fd, "|", 2);
-                    write(con->fd, "\n", 2);
-
-                    // FIXME to other client, grab file descriptor
-                    write(con->fd, "MOVD|16|", 9);
-                    write(con->fd, tokens[2], strlen(tokens[2]));
-                    write(con->fd, "|", 2);
-                    write(con->fd, tokens[3], strlen(tokens[3]));
-                    write(con->fd, "|", 2); 
-                    write(con->fd, tokens[2], strlen(board)); 
-                    write(con->fd, "|", 2);
-                    write(con->fd, "\n", 2);
-                }
-            }
-            else if(checkType(tokens[0]) == RSGN) {
-                active_game = 0;
-                write(con->fd, "OVER|", 6);
-                //write(con->fd, (strlen() + 6), 3); // FIXME grab player name and length
-                //write(con->fd, name, strlen(name));
-                write(con->fd, "has resigned.|", 6);
-
-                // FIXME PRINT TO OTHER PERSON HERE AS WELL
-            }
-            else if(checkType(tokens[0]) == DRAW && tokens[2][0] == 'S') {
-                draw_match = 1; //means draw is suggested
-                
-                // FIXME change this to write to the other client
-                write(con->fd, "DRAW|2|S|", 10);
-                write(con->fd, "\n", 2);
-            }
-            else if(checkType(tokens[0]) == DRAW && tokens[2][0] == 'R') {
-                //
-                if(draw_match == 0) {
-                    write(con->fd, "INVL|23|No draw suggested yet.|", 32); //no suggestion was made to reject or accept yet
-                    write(con->fd, "\n", 2);
-                }
-                else {
-                    draw_match = 0;
-                    // FIXME change this to write to the other client
-                    write(con->fd, "DRAW|2|R|", 10);
-                    write(con->fd, "\n", 2);
-                }
-            }
-            else if(checkType(tokens[0]) == DRAW && tokens[2][0] == 'A') {
-                //
-                if(draw_match == 0) {
-                    printf("INVL TYPE - TRY AGAIN"); //no suggestion was made to reject or accept yet
-                    write(con->fd, "\n", 2);
-                }
-                
-                else {
-                    active_game = 0;
+struct name_table {
+    pthread_mutex_t lock;
+    struct name** table; // Open addressing hash table of interned names
+    size_t capacity; // Slots in table, always a power of two
+    size_t count; // Names interned
+    size_t bytes; // Name and table memory, for --memtest
+};
 
-                    write(con->fd, "OVER|5|Draw|", 13);
-                    write(con->fd, "\n", 2);
+static struct name_table names = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0 };
 
-                    // FIXME make this to the other client
-                    write(con->fd, "OVER|5|Draw|", 13);
-                    write(con->fd, "\n", 2);
-                }
-            }
+static size_t name_hash(const char* name) {
+    size_t hash = 14695981039346656037ULL; // FNV-1a
+    for (; *name != '\0'; name++) hash = (hash ^ (unsigned char)*name) * 1099511628211ULL;
+    return hash;
+}
 
+// Returns the interned copy of name (at most 255 bytes, like every field) with one more reference held on it, NULL if
+// out of memory. The empty name is never stored and needs no release.
+const char* intern(const char* name) {
+    if (name[0] == '\0') return "";
+    pthread_mutex_lock(&names.lock);
+
+    // Keep the table at most 3/4 full so probes stay short
+    if ((names.count + 1) * 4 > names.capacity * 3) {
+        size_t capacity = names.capacity ? names.capacity * 2 : 1024;
+        struct name** table = calloc(capacity, sizeof(struct name*));
+        if (table == NULL) {
+            pthread_mutex_unlock(&names.lock);
+            return NULL;
+        }
+        for (size_t i = 0; i < names.capacity; i++) {
+            if (names.table[i] == NULL) continue;
+            size_t slot = name_hash(names.table[i]->text) & (capacity - 1);
+            while (table[slot] != NULL) slot = (slot + 1) & (capacity - 1);
+            table[slot] = names.table[i];
         }
+        free(names.table);
+        names.bytes += (capacity - names.capacity) * sizeof(struct name*);
+        names.table = table;
+        names.capacity = capacity;
+    }
 
-        for (int i = 0; i < 5; i++) {
-            free(tokens[i]);
+    size_t slot = name_hash(name) & (names.capacity - 1);
+    for (; names.table[slot] != NULL; slot = (slot + 1) & (names.capacity - 1)) {
+        if (strcmp(names.table[slot]->text, name) == 0) {
+            names.table[slot]->refs++;
+            pthread_mutex_unlock(&names.lock);
+            return names.table[slot]->text;
         }
-        free(tokens);
     }
 
-    if (bytes == 0) {
-        printf("[%s:%s] got EOF\n", host, port);
-    } else if (bytes == -1) {
-        printf("[%s:%s] terminating: %s\n", host, port, strerror(errno));
-    } else {
-        printf("[%s:%s] terminating\n", host, port);
+    size_t length = strnlen(name, 255);
+    struct name* copy = malloc(sizeof(struct name) + length + 1);
+    if (copy == NULL) {
+        pthread_mutex_unlock(&names.lock);
+        return NULL;
+    }
+    copy->refs = 1;
+    memcpy(copy->text, name, length);
+    copy->text[length] = '\0';
+    names.table[slot] = copy;
+    names.count++;
+    names.bytes += sizeof(struct name) + length + 1;
+
+    pthread_mutex_unlock(&names.lock);
+    return copy->text;
+}
+
+// Drops one reference taken by intern, the last one removes the name from the table and frees it
+void release_name(const char* text) {
+    if (text[0] == '\0') return;
+    struct name* name = (struct name*)(text - offsetof(struct name, text));
+
+    pthread_mutex_lock(&names.lock);
+    if (--name->refs > 0) {
+        pthread_mutex_unlock(&names.lock);
+        return;
     }
 
-    close(con->fd);
-    free(con);
+    size_t mask = names.capacity - 1;
+    size_t hole = name_hash(text) & mask;
+    while (names.table[hole] != name) hole = (hole + 1) & mask;
 
-    return NULL;
+    // Shift later names of the same probe run back into the hole, so lookups never stop short of them
+    for (size_t slot = (hole + 1) & mask; names.table[slot] != NULL; slot = (slot + 1) & mask) {
+        size_t home = name_hash(names.table[slot]->text) & mask;
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            names.table[hole] = names.table[slot];
+            hole = slot;
+        }
+    }
+    names.table[hole] = NULL;
+    names.count--;
+    names.bytes -= sizeof(struct name) + strlen(text) + 1;
+
+    pthread_mutex_unlock(&names.lock);
+    free(name);
 }
 
-// Method for setting up server sockets
+// Frees the table, only at shutdown once every game has released its names
+void free_names(void) {
+    for (size_t i = 0; i < names.capacity; i++) free(names.table[i]);
+    free(names.table);
+    names.table = NULL;
+    names.capacity = names.count = names.bytes = 0;
+}
 
-int open_listener(char *service, int queue_size)
-{
-    struct addrinfo hint, *info_list, *info;
-    int error, sock;
+// Server structure handing out games, only the main thread touches it
+// Games are not kept in a list: each one is owned by the players still in it and goes away with the last of them
+typedef struct {
+    struct game* waiting; // Newest game, its O seat is still open
+    int gameCount; // How many games the server has setup
+    int nextReactor; // Reactor thread the next connection goes to, round robin
+} server;
 
-    // Initialize hints
-    memset(&hint, 0, sizeof(struct addrinfo));
-    hint.ai_family = AF_UNSPEC;
-    hint.ai_socktype = SOCK_STREAM;
-    hint.ai_flags = AI_PASSIVE;
+// Messages for one player that their socket couldn't take yet, written out by the player's reactor on EPOLLOUT
+struct outbox {
+    struct connection* con; // NULL until the player is seated and again once they left or overflowed
+    int epfd; // Epoll set of the reactor serving con
+    uint16_t len; // Bytes queued
+    char* buf; // OUTBOX_SIZE bytes, only allocated while something is queued
+};
 
-    // Obtain information for listening socket
-    error = getaddrinfo(NULL, service, &hint, &info_list);
-    if (error) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(error));
-        return -1;
-    }
+// "game" structure that contains a game ID, 2 players in each game, board state, and the state machine word
+// Everything a move touches, the state word, the board and the outboxes its replies go through, comes first and
+// starts on its own cache line; names and the ID are only read when a game begins or ends and sit on a separate line
+struct game{
+    _Alignas(64) _Atomic uint32_t state; // Phase, draw offer, joined players and outcome, see GS_MAKE
+    _Atomic int players; // One for each connected player plus one for the open O seat, the last one out frees the game
+    struct board_state board; // Written only by the player whose move it is
+    pthread_mutex_t outLock; // Both players' reactors send to either player, this keeps messages whole and in order
+    struct outbox out[2]; // Per side, X first
+
+    _Alignas(64) int gameID; // based on gameCount of server
+    const char* playerOne; // Player 1's name, interned
+    const char* playerTwo; // Player 2 name, interned
+};
 
-    // Attempt to create socket
-    for (info = info_list; info != NULL; info = info->ai_next) {
-        sock = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+// Resets a game to WAITING with an empty classic board, the variant is set when X joins
+void game_init(struct game* match) {
+    board_init(&match->board, &variants[0]);
+    match->playerOne = "";
+    match->playerTwo = "";
+    atomic_store(&match->state, GS_MAKE(GS_WAITING, 0, 0, OUT_NONE, 0));
+}
 
-        // If we could not create the socket, try the next method
-        if (sock == -1) continue;
+// Sets up game server using server structure
+server* createGameServer() {
+    server *gameServer = malloc(sizeof(server));
+    gameServer->waiting = NULL;
+    gameServer->gameCount = 0;
+    gameServer->nextReactor = 0;
+    return gameServer;
+}
 
-        // Bind socket to requested port
-        error = bind(sock, info->ai_addr, info->ai_addrlen);
-        if (error) {
-            close(sock);
-            continue;
-        }
-        // Enable listening for incoming connection requests
-        error = listen(sock, QUEUE_SIZE);
-        if (error) {
-            close(sock);
-            continue;
+// Sets up a game instance using the game struct, held by X and the open O seat
+struct game* newGame(server* gameServer) {
+    struct game* match = tracked_alloc(_Alignof(struct game), sizeof(struct game));
+    if (match == NULL) return NULL;
+
+    // Some struct parameter initializers
+    match->gameID = gameServer->gameCount++;
+    atomic_init(&match->players, 2);
+    pthread_mutex_init(&match->outLock, NULL);
+    memset(match->out, 0, sizeof(match->out));
+    game_init(match);
+
+    return match;
+}
+
+// Drops one hold on a game, the last one releases the names and frees the game
+void game_release(struct game* match) {
+    if (atomic_fetch_sub(&match->players, 1) == 1) {
+        release_name(match->playerOne);
+        release_name(match->playerTwo);
+        pthread_mutex_destroy(&match->outLock);
+        tracked_free(match, sizeof(struct game));
+    }
+}
+
+// PLAY: records the player's name (X also picks the board), the second player to join starts the game
+// On success the game takes over the caller's reference to an interned name, otherwise the caller still holds it
+game_result game_join(struct game* match, int side, const char* name, const struct variant* variant) {
+    uint32_t state = atomic_load(&match->state);
+    if (GS_PHASE(state) == GS_OVER) return GR_OVER;
+    if (GS_PHASE(state) != GS_WAITING || (GS_JOINED(state) & (1 << side))) return GR_NOT_TURN;
+
+    // Nobody else reads these until the swap below publishes our joined bit
+    if (side == SIDE_X) match->playerOne = name;
+    else match->playerTwo = name;
+    if (side == SIDE_X) board_init(&match->board, variant);
+
+    for (;;) {
+        if (GS_PHASE(state) != GS_WAITING) {
+            // Opponent left before we got in
+            if (side == SIDE_X) match->playerOne = "";
+            else match->playerTwo = "";
+            return GR_OVER;
         }
-        // If we got this far, we have opened the socket
-        break;
+        int joined = GS_JOINED(state) | (1 << side);
+        uint32_t next = (joined == 3) ? GS_MAKE(GS_X_TO_MOVE, 0, joined, OUT_NONE, GS_SEQ(state) + 1)
+            : GS_MAKE(GS_WAITING, 0, joined, OUT_NONE, GS_SEQ(state) + 1);
+        if (atomic_compare_exchange_strong(&match->state, &state, next)) return (joined == 3) ? GR_BEGIN : GR_OK;
     }
+}
 
-    freeaddrinfo(info_list);
-    // Info will be NULL if no method succeeded
-    if (info == NULL) {
-        fprintf(stderr, "Could not bind\n");
-        return -1;
+// MOVE on a free cell, cells (if given) gets a copy of the board taken before the opponent can move again
+game_result game_play(struct game* match, int side, int cell, char* cells) {
+    struct board_state* board = &match->board;
+    uint32_t state = atomic_load(&match->state);
+
+    for (;;) {
+        if (GS_PHASE(state) == GS_OVER) return GR_OVER;
+        if (GS_PHASE(state) != GS_TO_MOVE(side)) return GR_NOT_TURN;
+        if (cell < 0 || cell >= board->variant.side * board->variant.side || board->cells[cell] != '.') return GR_INVALID;
+
+        move_result result = place_mark(board, cell, SIDE_MARK(side));
+        if (cells != NULL) memcpy(cells, board->cells, board->variant.side * board->variant.side + 1);
+
+        uint32_t next;
+        if (result == MV_WIN) next = GS_MAKE(GS_OVER, 0, 3, side == SIDE_X ? OUT_X_WINS : OUT_O_WINS, GS_SEQ(state) + 1);
+        else if (result == MV_DRAW) next = GS_MAKE(GS_OVER, 0, 3, OUT_DRAW, GS_SEQ(state) + 1);
+        else next = GS_MAKE(GS_TO_MOVE(!side), 0, 3, OUT_NONE, GS_SEQ(state) + 1);
+
+        if (atomic_compare_exchange_strong(&match->state, &state, next)) {
+            if (result == MV_WIN) return GR_WIN;
+            if (result == MV_DRAW) return GR_DRAW;
+            return GR_OK;
+        }
+        remove_mark(board, cell);
     }
+}
 
-    return sock;
+// MOVE given as an "r,c" string, only looked at once it is our turn since the board may be changing until then
+game_result game_move(struct game* match, int side, const char* position, char* cells) {
+    uint32_t state = atomic_load(&match->state);
+    if (GS_PHASE(state) == GS_OVER) return GR_OVER;
+    if (GS_PHASE(state) != GS_TO_MOVE(side)) return GR_NOT_TURN;
+    return game_play(match, side, check_position(&match->board, position), cells);
 }
 
-int main(int argc, char** argv)
-{
-    sigset_t mask;
-    struct connection_data *con;
-    int error;
-    pthread_t tid;
+// DRAW|S, only instead of a move
+game_result game_offer_draw(struct game* match, int side) {
+    uint32_t state = atomic_load(&match->state);
+    for (;;) {
+        if (GS_PHASE(state) == GS_OVER) return GR_OVER;
+        if (GS_PHASE(state) != GS_TO_MOVE(side)) return GR_NOT_TURN;
+        if (atomic_compare_exchange_strong(&match->state, &state, GS_MAKE(GS_DRAW_OFFERED, side, 3, OUT_NONE, GS_SEQ(state) + 1))) return GR_OK;
+    }
+}
 
-    char* service = argv[1]; // Port number "service" is the first argument for ttts.c 
+// DRAW|A or DRAW|R, only from the player the draw was offered to. Rejecting hands the move back to the offerer.
+game_result game_answer_draw(struct game* match, int side, int accept) {
+    uint32_t state = atomic_load(&match->state);
+    for (;;) {
+        if (GS_PHASE(state) == GS_OVER) return GR_OVER;
+        if (GS_PHASE(state) != GS_DRAW_OFFERED) return GR_NO_DRAW;
+        if (GS_OFFERER(state) == side) return GR_NOT_TURN;
+
+        uint32_t next = accept ? GS_MAKE(GS_OVER, 0, 3, OUT_DRAW, GS_SEQ(state) + 1)
+            : GS_MAKE(GS_TO_MOVE(!side), 0, 3, OUT_NONE, GS_SEQ(state) + 1);
+        if (atomic_compare_exchange_strong(&match->state, &state, next)) return accept ? GR_DRAW : GR_OK;
+    }
+}
 
-    install_handlers(&mask);
+// RSGN, allowed at any point. Leaving before the game began abandons it without a winner.
+game_result game_resign(struct game* match, int side) {
+    uint32_t state = atomic_load(&match->state);
+    for (;;) {
+        if (GS_PHASE(state) == GS_OVER) return GR_OVER;
 
-    int listener = open_listener(service, QUEUE_SIZE);
-    if (listener < 0) exit(EXIT_FAILURE);
+        int waiting = (GS_PHASE(state) == GS_WAITING);
+        uint32_t next = GS_MAKE(GS_OVER, 0, GS_JOINED(state), waiting ? OUT_NONE : (side == SIDE_X ? OUT_O_WINS : OUT_X_WINS), GS_SEQ(state) + 1);
+        if (atomic_compare_exchange_strong(&match->state, &state, next)) return waiting ? GR_ABANDONED : GR_OK;
+    }
+}
 
-    printf("Listening for incoming connections\n");
+// In-process self-play: bots play each other through the same game state machine the network handlers use, no sockets involved
+// Games are numbered and split into one range per worker. A worker takes chunks off the front of its own range and, once that
+// runs dry, steals the back half of another worker's range. Ranges are single atomic words updated by compare-and-swap, so
+// there are no locks, and results are counted per worker and only summed at the end.
+#define SELFPLAY_CHUNK 64 // Games a worker takes from its own range at a time
+#define SELFPLAY_PROBE 16 // Roughly one move in this many is sent as an "r,c" string alongside an invalid move that must be rejected
+#define RANGE(next, end) (((uint64_t)(end) << 32) | (uint32_t)(next))
+#define RANGE_NEXT(range) (uint32_t)(range)
+#define RANGE_END(range) (uint32_t)((range) >> 32)
+
+struct selfplay_worker {
+    _Alignas(64) _Atomic uint64_t range; // Games still owned by this worker, next in the low half and end in the high half
+    pthread_t tid;
+    int id;
+    int nworkers;
+    struct selfplay_worker* all;
+    const struct variant* variant;
+    uint64_t rng;
+
+    // Results, only touched by the owning worker
+    long games, moves, xwins, owins, draws, rejected, errors;
+};
 
-    server *gameServer = createGameServer();
-    int tempConnects = 0;
+// Takes up to SELFPLAY_CHUNK games off the front of the worker's own range
+int selfplay_take(struct selfplay_worker* w, uint32_t* first, uint32_t* count) {
+    uint64_t range = atomic_load(&w->range);
+    while (RANGE_NEXT(range) < RANGE_END(range)) {
+        uint32_t next = RANGE_NEXT(range), end = RANGE_END(range);
+        uint32_t n = (end - next < SELFPLAY_CHUNK) ? end - next : SELFPLAY_CHUNK;
+        if (atomic_compare_exchange_weak(&w->range, &range, RANGE(next + n, end))) {
+            *first = next;
+            *count = n;
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    while (active) {
-        con = (struct connection_data *)malloc(sizeof(struct connection_data));
-        con->addr_len = sizeof(struct sockaddr_storage);
-
-        con->fd = accept(listener, (struct sockaddr *)&con->addr, &con->addr_len);
-        if (con->fd < 0) {
-            perror("accept");
-            free(con);
-            // FIXME check for specific error conditions
-            continue;
+// Moves the back half of some other worker's range into this worker's (empty) range, returns 0 once there is nothing left to steal
+// A last single game is taken whole, otherwise the last game of a worker that never started would never be played
+int selfplay_steal(struct selfplay_worker* w) {
+    for (int i = 1; i < w->nworkers; i++) {
+        struct selfplay_worker* victim = &w->all[(w->id + i) % w->nworkers];
+        uint64_t range = atomic_load(&victim->range);
+        while (RANGE_NEXT(range) < RANGE_END(range)) {
+            uint32_t next = RANGE_NEXT(range), end = RANGE_END(range);
+            uint32_t mid = next + (end - next) / 2;
+            if (atomic_compare_exchange_weak(&victim->range, &range, RANGE(next, mid))) {
+                atomic_store(&w->range, RANGE(mid, end));
+                return 1;
+            }
         }
-        
-        //printf("This is before the moduluus check\n");
-        // Make a new game when needed
-        if (tempConnects % 2 == 0) { 
-            printf("Appending a new game to the server list\n");
-            newGame(gameServer);
+    }
+    return 0;
+}
+
+// Plays one random game and checks every engine answer against the slow checkers
+void selfplay_game(struct selfplay_worker* w, struct game* match) {
+    struct board_state* board = &match->board;
+    int free_cells[MAXCELLS];
+    int side = w->variant->side, cells = side * side;
+    char position[24];
+
+    game_init(match);
+    if (game_join(match, SIDE_X, "X-bot", w->variant) != GR_OK || game_join(match, SIDE_O, "O-bot", NULL) != GR_BEGIN) {
+        w->errors++;
+        return;
+    }
+    for (int i = 0; i < cells; i++) free_cells[i] = i;
+
+    game_result result = GR_OK;
+    int cell = 0, player = SIDE_X;
+    for (int left = cells; result == GR_OK; left--) {
+        player = board->moves & 1;
+        int pick = xorshift64(&w->rng) % left;
+        cell = free_cells[pick];
+        free_cells[pick] = free_cells[left - 1];
+        free_cells[left - 1] = cell; // Cells already played stay at the back of the list for the invalid move probes
+
+        if (xorshift64(&w->rng) % SELFPLAY_PROBE == 0) {
+            // The player not on move must be turned away, and a taken cell (or one just off the board before the first
+            // move) must be refused, both without touching the board
+            snprintf(position, sizeof(position), "%d,%d", cell / side + 1, cell % side + 1);
+            if (game_move(match, !player, position, NULL) == GR_NOT_TURN) w->rejected++;
+            else w->errors++;
+
+            if (board->moves > 0) {
+                int taken = free_cells[left + xorshift64(&w->rng) % (cells - left)];
+                snprintf(position, sizeof(position), "%d,%d", taken / side + 1, taken % side + 1);
+            }
+            else snprintf(position, sizeof(position), "%d,1", side + 1);
+            if (game_move(match, player, position, NULL) == GR_INVALID) w->rejected++;
+            else w->errors++;
+
+            snprintf(position, sizeof(position), "%d,%d", cell / side + 1, cell % side + 1);
+            result = game_move(match, player, position, NULL);
         }
-        tempConnects++;
+        else result = game_play(match, player, cell, NULL);
+        w->moves++;
+    }
 
-        // Temporarily disable signals
-        // (the worker thread will inherit this mask, ensuring that SIGINT is only delivered to this thread)
-        error = pthread_sigmask(SIG_BLOCK, &mask, NULL);
-        if (error != 0) {
-            fprintf(stderr, "sigmask: %s\n", strerror(error));
-            exit(EXIT_FAILURE);
+    char mark = SIDE_MARK(player);
+    uint32_t state = atomic_load(&match->state);
+    if (result == GR_WIN) {
+        // The line must really be there, and must not have been there before the last move
+        int found = board_has_line(board, mark);
+        board->cells[cell] = '.';
+        if (!found || board_has_line(board, mark)) w->errors++;
+        board->cells[cell] = mark;
+        if (GS_OUTCOME(state) != (player == SIDE_X ? OUT_X_WINS : OUT_O_WINS)) w->errors++;
+        if (player == SIDE_X) w->xwins++;
+        else w->owins++;
+    }
+    else if (result == GR_DRAW) {
+        if (board->moves != cells || board_has_line(board, 'X') || board_has_line(board, 'O')) w->errors++;
+        if (GS_OUTCOME(state) != OUT_DRAW) w->errors++;
+        w->draws++;
+    }
+    else w->errors++;
+    if (GS_PHASE(state) != GS_OVER || game_play(match, !player, cell, NULL) != GR_OVER) w->errors++;
+    w->games++;
+}
+
+void *selfplay_worker(void *arg) {
+    struct selfplay_worker* w = arg;
+    struct game* match = aligned_alloc(_Alignof(struct game), sizeof(struct game));
+    uint32_t first, count;
+
+    do {
+        while (selfplay_take(w, &first, &count)) {
+            for (uint32_t i = 0; i < count; i++) selfplay_game(w, match);
         }
+    } while (selfplay_steal(w));
+
+    free(match);
+    return NULL;
+}
+
+// ttts --selfplay [games] [threads] [variant]: prints throughput and the result distribution, fails if any check did
+int selfplay(long games, int nworkers, const char* spec) {
+    struct variant variant;
+    if (variant_lookup(spec, &variant) == -1) {
+        fprintf(stderr, "Unknown board variant %s\n", spec);
+        return EXIT_FAILURE;
+    }
+    if (games > UINT32_MAX) games = UINT32_MAX;
+
+    struct selfplay_worker* workers = aligned_alloc(_Alignof(struct selfplay_worker), nworkers * sizeof(struct selfplay_worker));
+    for (int i = 0; i < nworkers; i++) {
+        memset(&workers[i], 0, sizeof(struct selfplay_worker));
+        atomic_init(&workers[i].range, RANGE(games * i / nworkers, games * (i + 1) / nworkers));
+        workers[i].id = i;
+        workers[i].nworkers = nworkers;
+        workers[i].all = workers;
+        workers[i].variant = &variant;
+        workers[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+    }
 
-        error = pthread_create(&tid, NULL, read_data, con);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int started = 0;
+    for (; started < nworkers; started++) {
+        int error = pthread_create(&workers[started].tid, NULL, selfplay_worker, &workers[started]);
         if (error != 0) {
+            // Whoever did start will steal the missing workers' games
             fprintf(stderr, "pthread_create: %s\n", strerror(error));
-            close(con->fd);
-            free(con);
-            continue;
+            break;
         }
+    }
+    if (started == 0) selfplay_worker(&workers[0]);
+    for (int i = 0; i < started; i++) pthread_join(workers[i].tid, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    struct selfplay_worker total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < nworkers; i++) {
+        total.games += workers[i].games;
+        total.moves += workers[i].moves;
+        total.xwins += workers[i].xwins;
+        total.owins += workers[i].owins;
+        total.draws += workers[i].draws;
+        total.rejected += workers[i].rejected;
+        total.errors += workers[i].errors;
+    }
+    free(workers);
 
-        // Automatically clean up child threads once they terminate
-        pthread_detach(tid);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double played = total.games > 0 ? total.games : 1;
+    printf("variant %dx%d, %d in a row (%s), %d threads\n", variant.side, variant.side, variant.k,
+        variant.kernel != NULL ? "bitboard kernel" : "generic checker", started > 0 ? started : 1);
+    printf("games %ld in %.3fs: %.0f games/sec, %.0f moves/sec\n", total.games, secs, total.games / secs, total.moves / secs);
+    printf("X wins %.2f%%, O wins %.2f%%, draws %.2f%%\n", 100.0 * total.xwins / played, 100.0 * total.owins / played, 100.0 * total.draws / played);
+    printf("invalid moves rejected %ld, errors %ld\n", total.rejected, total.errors);
 
-        // Unblock handled signals
-        error = pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
-        if (error != 0) {
-            fprintf(stderr, "sigmask: %s\n", strerror(error));
-            exit(EXIT_FAILURE);
-        }
+    if (total.games != games || total.errors != 0) return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
+
+// ttts --stress: both players' handlers hammering one game at the same time
+// Two threads, one per side, fire random moves, draw offers and answers and the odd resignation at a single shared game
+// without waiting for their turn. When the game ends they meet at a barrier, one thread checks that the board and the
+// state word agree with what each side was told, and the game is reset for the next round.
+#define STRESS_ACTIONS 1000 // Out of this many actions, STRESS_MOVE are moves, the rest draw offers, draw answers and a resignation
+#define STRESS_MOVE 900
+
+struct stress_side {
+    pthread_t tid;
+    int side;
+    struct game* match;
+    pthread_barrier_t* barrier;
+    const struct variant* variant;
+    long rounds;
+    uint64_t rng;
+
+    // Per round, only read by the checker once both sides are at the barrier
+    int moves; // Marks this side got onto the board
+    game_result ended; // How this side ended the game, GR_OK if it didn't
+
+    long actions, refused, errors;
+    long wins, draws, resigns; // Rounds this side ended, by how
+};
+
+// Checks one finished round, run by the X thread while O waits at the barrier
+void stress_check(struct stress_side* x, struct stress_side* o) {
+    struct board_state* board = &x->match->board;
+    uint32_t state = atomic_load(&x->match->state);
+    int xmarks = 0, omarks = 0;
+
+    for (int i = 0; board->cells[i] != '\0'; i++) {
+        if (board->cells[i] == 'X') xmarks++;
+        else if (board->cells[i] == 'O') omarks++;
     }
 
-    // Free game server and all associated games
-    struct game *temp;
-    while(gameServer->first != NULL)
-    {   
-        temp = gameServer->first;
-        gameServer->first = gameServer->first->next;
-        free(temp);
+    // Moves alternate starting with X, and every accepted move is on the board exactly once
+    if (xmarks != x->moves || omarks != o->moves || xmarks - omarks < 0 || xmarks - omarks > 1) x->errors++;
+    if (GS_PHASE(state) != GS_OVER) x->errors++;
+
+    // Exactly one side saw its action end the game, and the outcome is the one it was told
+    struct stress_side* ender = (x->ended != GR_OK) ? x : o;
+    if ((x->ended != GR_OK) == (o->ended != GR_OK)) {
+        x->errors++;
+        return;
     }
 
+    int win = (ender->side == SIDE_X) ? OUT_X_WINS : OUT_O_WINS, loss = (ender->side == SIDE_X) ? OUT_O_WINS : OUT_X_WINS;
+    int lines = board_has_line(board, 'X') + board_has_line(board, 'O');
+    if (ender->ended == GR_WIN) {
+        if (GS_OUTCOME(state) != win || !board_has_line(board, SIDE_MARK(ender->side)) || lines != 1) x->errors++;
+    }
+    else if (ender->ended == GR_DRAW) {
+        if (GS_OUTCOME(state) != OUT_DRAW || lines != 0) x->errors++;
+    }
+    else if (ender->ended == GR_ABANDONED) {
+        if (GS_OUTCOME(state) != loss || lines != 0) x->errors++;
+    }
+    else x->errors++;
+}
+
+void *stress_worker(void *arg) {
+    struct stress_side* me = arg;
+    struct stress_side* all = me - me->side; // Both sides live in one array, X first
+    struct game* match = me->match;
+    int cells = me->variant->side * me->variant->side;
+
+    for (long round = 0; round < me->rounds; round++) {
+        me->moves = 0;
+        me->ended = GR_OK;
+
+        // Both sides join at once, so the join race is part of every round as well
+        game_result joined = game_join(match, me->side, me->side == SIDE_X ? "X-stress" : "O-stress", me->variant);
+        if (joined != GR_OK && joined != GR_BEGIN) me->errors++;
+        while (GS_PHASE(atomic_load(&match->state)) == GS_WAITING) sched_yield();
+
+        while (GS_PHASE(atomic_load(&match->state)) != GS_OVER) {
+            int action = xorshift64(&me->rng) % STRESS_ACTIONS;
+            game_result result;
+            me->actions++;
+
+            if (action < STRESS_MOVE) {
+                result = game_play(match, me->side, xorshift64(&me->rng) % cells, NULL);
+                if (result == GR_OK || result == GR_WIN || result == GR_DRAW) me->moves++;
+                if (result == GR_WIN || result == GR_DRAW) me->ended = result;
+            }
+            else if (action < 940) {
+                result = game_offer_draw(match, me->side);
+            }
+            else if (action < STRESS_ACTIONS - 1) {
+                result = game_answer_draw(match, me->side, action < 950);
+                if (result == GR_DRAW) me->ended = GR_DRAW;
+            }
+            else {
+                result = game_resign(match, me->side);
+                if (result == GR_OK) me->ended = GR_ABANDONED; // Resigned while under way
+                else if (result == GR_ABANDONED) me->errors++; // Game had already begun
+            }
+            if (result == GR_NOT_TURN || result == GR_INVALID || result == GR_NO_DRAW || result == GR_OVER) {
+                // Give the other side a look in now and then, otherwise on few cores rounds mostly end in resignations
+                me->refused++;
+                if ((xorshift64(&me->rng) & 63) == 0) sched_yield();
+            }
+        }
+
+        if (me->ended == GR_WIN) me->wins++;
+        else if (me->ended == GR_DRAW) me->draws++;
+        else if (me->ended == GR_ABANDONED) me->resigns++;
+
+        pthread_barrier_wait(me->barrier);
+        if (me->side == SIDE_X) {
+            stress_check(&all[SIDE_X], &all[SIDE_O]);
+            game_init(match);
+        }
+        pthread_barrier_wait(me->barrier);
+    }
+
+    return NULL;
+}
+
+// ttts --stress [rounds] [variant]: fails if any round ends up inconsistent
+int stress(long rounds, const char* spec) {
+    struct variant variant;
+    if (variant_lookup(spec, &variant) == -1) {
+        fprintf(stderr, "Unknown board variant %s\n", spec);
+        return EXIT_FAILURE;
+    }
+
+    struct game* match = aligned_alloc(_Alignof(struct game), sizeof(struct game));
+    game_init(match);
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, 2);
+
+    struct stress_side sides[2];
+    memset(sides, 0, sizeof(sides));
+    for (int side = SIDE_X; side <= SIDE_O; side++) {
+        sides[side].side = side;
+        sides[side].match = match;
+        sides[side].barrier = &barrier;
+        sides[side].variant = &variant;
+        sides[side].rounds = rounds;
+        sides[side].rng = 0x9E3779B97F4A7C15ULL * (side + 1);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int side = SIDE_X; side <= SIDE_O; side++) {
+        int error = pthread_create(&sides[side].tid, NULL, stress_worker, &sides[side]);
+        if (error != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(error));
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int side = SIDE_X; side <= SIDE_O; side++) pthread_join(sides[side].tid, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    pthread_barrier_destroy(&barrier);
+    free(match);
+
+    long actions = sides[SIDE_X].actions + sides[SIDE_O].actions;
+    long refused = sides[SIDE_X].refused + sides[SIDE_O].refused;
+    long errors = sides[SIDE_X].errors + sides[SIDE_O].errors;
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("variant %dx%d, %d in a row, %ld rounds in %.3fs\n", variant.side, variant.side, variant.k, rounds, secs);
+    printf("actions %ld (%.0f/sec), refused %ld, errors %ld\n", actions, actions / secs, refused, errors);
+    printf("rounds won %ld, drawn %ld, resigned %ld\n", sides[SIDE_X].wins + sides[SIDE_O].wins,
+        sides[SIDE_X].draws + sides[SIDE_O].draws, sides[SIDE_X].resigns + sides[SIDE_O].resigns);
+
+    return (errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Frees what is queued for a player, and stops queueing any more for them
+void outbox_clear(struct outbox* out) {
+    if (out->buf != NULL) tracked_free(out->buf, OUTBOX_SIZE);
+    out->buf = NULL;
+    out->len = 0;
+    out->con = NULL;
+}
+
+// Formats a message body and sends one player of a game TYPE|size|body. Whatever their socket can't take right now is
+// queued and written out in order by their reactor, so a message is never dropped or cut short while the player is
+// still there; one who lets more than OUTBOX_SIZE bytes pile up is disconnected instead.
+void send_msg(struct game* match, int side, const char* type, const char* format, ...) {
+    char body[BUFSIZE], msg[BUFSIZE + 16];
+    va_list args;
+
+    va_start(args, format);
+    int bodyLength = vsnprintf(body, BUFSIZE, format, args);
+    va_end(args);
+    if (bodyLength >= BUFSIZE) bodyLength = BUFSIZE - 1;
+    int msgLength = snprintf(msg, sizeof(msg), "%s|%d|%s\n", type, bodyLength, body);
+
+    pthread_mutex_lock(&match->outLock);
+    struct outbox* out = &match->out[side];
+    if (out->con == NULL) {
+        pthread_mutex_unlock(&match->outLock); // Left already, nobody to tell
+        return;
+    }
+
+    int fd = out->con->fd, sent = 0;
+    if (out->len == 0) {
+        sent = write(fd, msg, msgLength);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            // Gone, their reactor will see the hang up
+            printf("Could not write to client %d: %s\n", fd, strerror(errno));
+            pthread_mutex_unlock(&match->outLock);
+            return;
+        }
+        if (sent < 0) sent = 0;
+    }
+
+    if (sent < msgLength) {
+        if (out->len + msgLength - sent > OUTBOX_SIZE || (out->buf == NULL && (out->buf = tracked_alloc(1, OUTBOX_SIZE)) == NULL)) {
+            printf("[fd %d] not reading its messages, disconnecting\n", fd);
+            shutdown(fd, SHUT_RDWR); // Its reactor sees the hang up and closes it
+            outbox_clear(out);
+        }
+        else {
+            if (out->len == 0) {
+                // Ask the reactor serving the player to write the rest once there is room
+                struct epoll_event event;
+                event.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+                event.data.ptr = out->con;
+                epoll_ctl(out->epfd, EPOLL_CTL_MOD, fd, &event);
+            }
+            memcpy(out->buf + out->len, msg + sent, msgLength - sent);
+            out->len += msgLength - sent;
+        }
+    }
+    pthread_mutex_unlock(&match->outLock);
+}
+
+// After a resignation abandoned a game still WAITING: whether the other player had already sent PLAY and is waiting
+// for a BEGN that will never come. The joined bits are frozen once the game is over; if their join lost the race
+// instead, game_join has already told them.
+int opponent_joined(struct game* match, int side) {
+    return (GS_JOINED(atomic_load(&match->state)) & (1 << !side)) != 0;
+}
+
+// Leaving ends the game for the opponent as if we had resigned
+// Every write to our socket goes through our outbox, so once that is cleared nobody can touch the fd and it is closed
+// right away instead of lingering until the game goes
+void leave_game(struct connection* con) {
+    struct game* match = con->game;
+    pthread_mutex_lock(&match->outLock);
+    if (match->out[con->side].con == con) outbox_clear(&match->out[con->side]);
+    pthread_mutex_unlock(&match->outLock);
+    close(con->fd);
+
+    const char* name = (con->side == SIDE_X) ? match->playerOne : match->playerTwo;
+    game_result result = game_resign(match, con->side);
+    if (result == GR_OK) send_msg(match, !con->side, "OVER", "W|%s has left.|", name);
+    else if (result == GR_ABANDONED && opponent_joined(match, con->side)) {
+        send_msg(match, !con->side, "OVER", "D|Your opponent left before the game began.|");
+    }
+    game_release(match);
+}
+
+// Handles one complete, already validated message from a client
+void handle_message(struct connection* con, char* buf)
+{
+    // Parse message
+    char** tokens = malloc(sizeof(char*) * 5); //MAX FIELDS
+    memset(tokens, (char) 0, 5);
+    for (int i = 0; i < 5; i++) {
+        tokens[i] = malloc(sizeof(char) * 256); //MAX FIELD SIZE
+        memset(tokens[i], (char) 0, 256);
+    }
+
+    int tokerror = tokenize(buf, tokens);
+    if (tokerror != 0) {//error has occured tokenizing
+        printf("Error occured while tokenizing!\n"); // FIXME more specific error checking
+    }
+    else {
+        printf("First Token: %s\n", tokens[0]);
+        struct game* match = con->game;
+        int side = con->side;
+        const char* name = (side == SIDE_X) ? match->playerOne : match->playerTwo;
+
+        if(checkType(tokens[0]) == PLAY) {
+            printf("Player Name: %s\n", tokens[2]); ///CHECK IF NAME IS TAKEN
+
+            // Optional fourth field picks the board, e.g. PLAY|8|Joe|4x4| or PLAY|8|Joe|7,4|
+            // Only X's choice counts, O plays on whatever X picked, so BEGN names the board unless it is the classic one
+            // The name is only interned once the board checks out, so a rejected PLAY holds no reference
+            struct variant variant;
+            const char* player = NULL;
+            if (variant_lookup(tokens[3], &variant) == -1) {
+                send_msg(match, side, "INVL", "Unknown board variant.|");
+            }
+            else if ((player = intern(tokens[2])) == NULL) {
+                send_msg(match, side, "INVL", "Server is out of memory.|");
+            }
+            else {
+                game_result result = game_join(match, side, player, &variant);
+                if (result == GR_OK || result == GR_BEGIN) send_msg(match, side, "WAIT", "");
+                if (result == GR_BEGIN) {
+                    // Last one in starts the game for both
+                    char board[24] = "";
+                    const struct variant* picked = &match->board.variant;
+                    if (picked->side != 3 || picked->k != 3) snprintf(board, sizeof(board), "%d,%d|", picked->side, picked->k);
+                    send_msg(match, SIDE_X, "BEGN", "X|%s|%s", match->playerTwo, board);
+                    send_msg(match, SIDE_O, "BEGN", "O|%s|%s", match->playerOne, board);
+                }
+                else if (result == GR_NOT_TURN) send_msg(match, side, "INVL", "Already playing.|");
+                else if (result == GR_OVER) send_msg(match, side, "OVER", "D|Your opponent left before the game began.|");
+                if (result != GR_OK && result != GR_BEGIN) release_name(player);
+            }
+        }
+        else if(checkType(tokens[0]) == MOVE && (tokens[2][0] != SIDE_MARK(side) || tokens[2][1] != '\0')) {
+            send_msg(match, side, "INVL", "That is not your role.|"); // e.g. MOVE|6|X|2,2| from O
+        }
+        else if(checkType(tokens[0]) == MOVE) {
+            char cells[MAXCELLS + 1];
+            game_result result = game_move(match, side, tokens[3], cells);
+
+            if (result == GR_INVALID) {
+                printf("INVL|24|That space is occupied.|\n");
+                send_msg(match, side, "INVL", "That space is occupied.|");
+            }
+            else if (result == GR_NOT_TURN) send_msg(match, side, "INVL", "It is not your turn.|");
+            else if (result == GR_OVER) send_msg(match, side, "INVL", "The game is over.|");
+            else {
+                // Board size depends on the variant, so the MOVD size field is worked out by send_msg
+                send_msg(match, side, "MOVD", "%s|%s|%s|", tokens[2], tokens[3], cells);
+                send_msg(match, !side, "MOVD", "%s|%s|%s|", tokens[2], tokens[3], cells);
+
+                if (result == GR_WIN) {
+                    send_msg(match, side, "OVER", "W|%s has completed a line.|", name);
+                    send_msg(match, !side, "OVER", "L|%s has completed a line.|", name);
+                }
+                else if (result == GR_DRAW) {
+                    send_msg(match, side, "OVER", "D|The grid is full.|");
+                    send_msg(match, !side, "OVER", "D|The grid is full.|");
+                }
+            }
+        }
+        else if(checkType(tokens[0]) == RSGN) {
+            game_result result = game_resign(match, side);
+            if (result == GR_OK) {
+                send_msg(match, side, "OVER", "L|%s has resigned.|", name);
+                send_msg(match, !side, "OVER", "W|%s has resigned.|", name);
+            }
+            else if (result == GR_ABANDONED) {
+                send_msg(match, side, "OVER", "L|%s has resigned.|", name);
+                if (opponent_joined(match, side)) send_msg(match, !side, "OVER", "D|Your opponent left before the game began.|");
+            }
+            else send_msg(match, side, "INVL", "The game is over.|");
+        }
+        else if(checkType(tokens[0]) == DRAW && tokens[2][0] == 'S') {
+            game_result result = game_offer_draw(match, side); // means draw is suggested
+            if (result == GR_OK) send_msg(match, !side, "DRAW", "S|");
+            else if (result == GR_OVER) send_msg(match, side, "INVL", "The game is over.|");
+            else send_msg(match, side, "INVL", "It is not your turn.|");
+        }
+        else if(checkType(tokens[0]) == DRAW && (tokens[2][0] == 'R' || tokens[2][0] == 'A')) {
+            int accept = (tokens[2][0] == 'A');
+            game_result result = game_answer_draw(match, side, accept);
+            if (result == GR_NO_DRAW || result == GR_NOT_TURN) {
+                send_msg(match, side, "INVL", "No draw suggested yet.|"); //no suggestion was made to reject or accept yet
+            }
+            else if (result == GR_OVER) send_msg(match, side, "INVL", "The game is over.|");
+            else if (accept) {
+                send_msg(match, side, "OVER", "D|%s accepted a draw.|", name);
+                send_msg(match, !side, "OVER", "D|%s accepted a draw.|", name);
+            }
+            else send_msg(match, !side, "DRAW", "R|");
+        }
+    }
+
+    for (int i = 0; i < 5; i++) {
+        free(tokens[i]);
+    }
+    free(tokens);
+}
+
+// Reactor threads: one per core, each with its own epoll set, so an idle connection costs a struct connection and a
+// slot in the kernel's epoll set instead of a thread. main hands new connections over on a lock-free stack and wakes the
+// reactor, which adopts them into its own list (only that reactor ever touches it) and registers them itself, so a
+// connection it fails to register is closed like any other instead of waiting forever.
+#define READSIZE 4096 // Bytes read from a ready connection at a time
+#define MAXEVENTS 64
+
+struct reactor {
+    _Alignas(64) _Atomic(struct connection*) incoming; // Pushed by main, linked through next
+    int epfd;
+    int wakefd; // eventfd in epfd with a NULL data pointer, written by main when incoming stops being empty
+    pthread_t tid;
+    struct connection* live; // Connections this reactor owns
+    char scratch[FRAMESIZE + READSIZE]; // Pending bytes of a connection followed by what was just read
+};
+
+struct reactor* reactors = NULL;
+int nreactors = 0;
+
+// Cleared by stop_reactors rather than going with active, so reactors keep adopting until main is done handing over
+atomic_int reactorsRunning = 0;
+
+// Connections (so sockets) currently open, the accept thread counts them up and reactors count them down once closed
+_Atomic long liveConnections = 0;
+
+void close_connection(struct reactor* r, struct connection* con) {
+    printf("[fd %d] closing\n", con->fd);
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, con->fd, NULL);
+
+    if (con->prev != NULL) con->prev->next = con->next;
+    else r->live = con->next;
+    if (con->next != NULL) con->next->prev = con->prev;
+
+    leave_game(con);
+    if (con->buf != NULL) tracked_free(con->buf, FRAMESIZE);
+    tracked_free(con, sizeof(struct connection));
+    atomic_fetch_sub(&liveConnections, 1);
+}
+
+// Takes every connection main has handed over into this reactor's own list and starts watching it
+// EPOLLOUT is asked for from the start in case the opponent already queued something for it before it was registered
+void adopt_incoming(struct reactor* r) {
+    struct connection* con = atomic_exchange(&r->incoming, NULL);
+    while (con != NULL) {
+        struct connection* next = con->next;
+        con->prev = NULL;
+        con->next = r->live;
+        if (r->live != NULL) r->live->prev = con;
+        r->live = con;
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+        event.data.ptr = con;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, con->fd, &event) < 0) {
+            perror("epoll_ctl");
+            close_connection(r, con); // Leaves its game, so the opponent isn't left waiting
+        }
+        con = next;
+    }
+}
+
+// Reads what a client sent and handles every complete message in it
+// A partial message at the end is kept in a buffer allocated just for the time it is pending
+void read_connection(struct reactor* r, struct connection* con) {
+    char* data = r->scratch;
+    int len = con->pending;
+    if (len > 0) memcpy(data, con->buf, len);
+
+    int bytes = read(con->fd, data + len, READSIZE);
+    if (bytes == 0 || (bytes < 0 && errno != EAGAIN && errno != EINTR)) {
+        if (bytes == 0) printf("[fd %d] got EOF\n", con->fd);
+        else printf("[fd %d] terminating: %s\n", con->fd, strerror(errno));
+        close_connection(r, con);
+        return;
+    }
+    if (bytes < 0) return;
+    len += bytes;
+
+    int off = 0;
+    while (off < len) {
+        // ttt sends whole lines, so skip the newline (or stray spaces) between messages
+        if (data[off] == '\n' || data[off] == '\r' || data[off] == ' ') {
+            off++;
+            continue;
+        }
+
+        int frame = frameLength(data + off, len - off);
+        if (frame == 0) break;
+
+        char msg[FRAMESIZE + 1];
+        if (frame > 0) {
+            memcpy(msg, data + off, frame);
+            msg[frame] = '\0';
+            off += frame;
+            printf("[fd %d] read %d bytes |%s|\n", con->fd, frame, msg);
+        }
+
+        // Packet and field error checking
+        // Errors go straight to the socket, so check under the output lock: nothing from the opponent gets in between,
+        // and a client that still has part of a message queued isn't told at all since it would land inside that message
+        struct game* match = con->game;
+        pthread_mutex_lock(&match->outLock);
+        struct outbox* out = &match->out[con->side];
+        int reportFd = (out->con == con && out->len > 0) ? -1 : con->fd;
+        msg_err err = (frame < 0) ? INVLFORM : parsePacket(msg, reportFd);
+        if (err != VALID) {
+            printf("Message is malformed! Ending connection now\n");
+            if (reportFd >= 0) write(reportFd, "Message is malformed! Ending connection now\n", 45);
+            if (out->con == con) outbox_clear(out); // Nothing more goes out before it is closed
+        }
+        pthread_mutex_unlock(&match->outLock);
+        if (err != VALID) {
+            close_connection(r, con);
+            return;
+        }
+
+        handle_message(con, msg);
+    }
+
+    con->pending = len - off;
+    if (con->pending > 0) {
+        if (con->buf == NULL) con->buf = tracked_alloc(1, FRAMESIZE);
+        if (con->buf == NULL) {
+            close_connection(r, con);
+            return;
+        }
+        memmove(con->buf, data + off, con->pending);
+    }
+    else if (con->buf != NULL) {
+        tracked_free(con->buf, FRAMESIZE);
+        con->buf = NULL;
+    }
+}
+
+// Writes out what is queued for a connection now that its socket has room, and stops asking for EPOLLOUT once it is all
+// gone (or the connection overflowed and is about to be closed)
+void flush_connection(struct reactor* r, struct connection* con) {
+    struct game* match = con->game;
+    pthread_mutex_lock(&match->outLock);
+    struct outbox* out = &match->out[con->side];
+
+    if (out->con == con && out->len > 0) {
+        int sent = write(con->fd, out->buf, out->len);
+        if (sent > 0) {
+            memmove(out->buf, out->buf + sent, out->len - sent);
+            out->len -= sent;
+        }
+    }
+    if (out->con != con || out->len == 0) {
+        if (out->buf != NULL) {
+            tracked_free(out->buf, OUTBOX_SIZE);
+            out->buf = NULL;
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.ptr = con;
+        epoll_ctl(r->epfd, EPOLL_CTL_MOD, con->fd, &event);
+    }
+    pthread_mutex_unlock(&match->outLock);
+}
+
+void *reactor_loop(void *arg) {
+    struct reactor* r = arg;
+    struct epoll_event events[MAXEVENTS];
+
+    while (atomic_load(&reactorsRunning)) {
+        // Sleeps until there is work, stop_reactors wakes it through wakefd
+        int ready = epoll_wait(r->epfd, events, MAXEVENTS, -1);
+        adopt_incoming(r);
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == NULL) {
+                uint64_t wakeups;
+                read(r->wakefd, &wakeups, sizeof(wakeups)); // Already adopted above
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) flush_connection(r, events[i].data.ptr);
+            if (events[i].events & ~EPOLLOUT) read_connection(r, events[i].data.ptr);
+        }
+    }
+
+    adopt_incoming(r);
+    while (r->live != NULL) close_connection(r, r->live);
+    return NULL;
+}
+
+// Starts one reactor per core with the signals in mask blocked, so they only go to the calling thread
+int start_reactors(sigset_t *mask) {
+    nreactors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nreactors < 1) nreactors = 1;
+    reactors = aligned_alloc(_Alignof(struct reactor), nreactors * sizeof(struct reactor));
+    if (reactors == NULL) return -1;
+    atomic_store(&reactorsRunning, 1);
+
+    int error = pthread_sigmask(SIG_BLOCK, mask, NULL);
+    if (error != 0) {
+        fprintf(stderr, "sigmask: %s\n", strerror(error));
+        return -1;
+    }
+
+    for (int i = 0; i < nreactors; i++) {
+        atomic_init(&reactors[i].incoming, NULL);
+        reactors[i].live = NULL;
+        reactors[i].epfd = epoll_create1(0);
+        reactors[i].wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (reactors[i].epfd < 0 || reactors[i].wakefd < 0) {
+            perror("epoll_create1");
+            return -1;
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (epoll_ctl(reactors[i].epfd, EPOLL_CTL_ADD, reactors[i].wakefd, &event) < 0) {
+            perror("epoll_ctl");
+            return -1;
+        }
+        error = pthread_create(&reactors[i].tid, NULL, reactor_loop, &reactors[i]);
+        if (error != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(error));
+            return -1;
+        }
+    }
+
+    error = pthread_sigmask(SIG_UNBLOCK, mask, NULL);
+    if (error != 0) {
+        fprintf(stderr, "sigmask: %s\n", strerror(error));
+        return -1;
+    }
+    return 0;
+}
+
+// Only once main has stopped accepting: every connection handed over by then is adopted and closed before they exit
+void stop_reactors(void) {
+    atomic_store(&reactorsRunning, 0);
+    uint64_t wakeup = 1;
+    for (int i = 0; i < nreactors; i++) write(reactors[i].wakefd, &wakeup, sizeof(wakeup));
+    for (int i = 0; i < nreactors; i++) {
+        pthread_join(reactors[i].tid, NULL);
+        close(reactors[i].epfd);
+        close(reactors[i].wakefd);
+    }
+    free(reactors);
+    reactors = NULL;
+}
+
+// Seats a new connection in a game and hands it to a reactor
+// Join the waiting game as O, unless its X already left, otherwise make a new game with us as X
+// fd must already be non-blocking
+int admit_connection(server* gameServer, int fd) {
+    struct connection* con = tracked_alloc(_Alignof(struct connection), sizeof(struct connection));
+    if (con == NULL) return -1;
+    con->fd = fd;
+    con->pending = 0;
+    con->buf = NULL;
+
+    struct reactor* r = &reactors[gameServer->nextReactor++ % nreactors];
+    struct game* waiting = gameServer->waiting;
+    if (waiting != NULL && GS_PHASE(atomic_load(&waiting->state)) == GS_WAITING) {
+        con->game = waiting; // O takes over the seat's hold on the game
+        con->side = SIDE_O;
+        gameServer->waiting = NULL;
+    }
+    else {
+        if (waiting != NULL) game_release(waiting); // X left before anyone took the seat
+        printf("Appending a new game to the server list\n");
+        waiting = newGame(gameServer);
+        if (waiting == NULL) {
+            gameServer->waiting = NULL;
+            tracked_free(con, sizeof(struct connection));
+            return -1;
+        }
+        con->game = waiting;
+        con->side = SIDE_X;
+        gameServer->waiting = waiting;
+    }
+
+    pthread_mutex_lock(&con->game->outLock);
+    con->game->out[con->side].con = con;
+    con->game->out[con->side].epfd = r->epfd;
+    pthread_mutex_unlock(&con->game->outLock);
+
+    atomic_fetch_add(&liveConnections, 1); // Before a reactor can close it again
+    struct connection* head = atomic_load(&r->incoming);
+    do con->next = head;
+    while (!atomic_compare_exchange_weak(&r->incoming, &head, con));
+
+    // Only the push onto an empty stack needs to wake the reactor, it takes the whole stack at once. con itself may
+    // already be adopted and relinked by now, so the old head is looked at instead.
+    if (head == NULL) {
+        uint64_t one = 1;
+        write(r->wakefd, &one, sizeof(one));
+    }
+    return 0;
+}
+
+// Raises the soft fd limit as far as the hard limit allows, returns the new soft limit
+long raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) return 1024;
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) != 0) getrlimit(RLIMIT_NOFILE, &limit);
+    return (limit.rlim_cur > LONG_MAX) ? LONG_MAX : (long)limit.rlim_cur;
+}
+
+// Admission control on the accept path, only ever touched by the thread accepting
+// Each source gets a token bucket: BURST_PER_IP connections straight away, then RATE_PER_IP per second. A source is an
+// IPv4 address or an IPv6 /64, since one IPv6 host usually has a whole /64 to pick addresses from. Buckets live in a
+// small open addressing table; when a probe finds no free slot the stalest bucket in it is handed to the new source
+// along with whatever tokens it has built up, so churning through sources doesn't earn fresh bursts once the table is
+// full. A client over either limit is closed as soon as it is accepted, before any memory is spent on it.
+#define BUCKETS 4096 // Buckets kept, one per recently seen source address, power of two
+#define BUCKET_PROBE 8 // Slots looked at before evicting one
+#define ACCEPT_BATCH 1024 // Most accepts before going back to poll, so shutdown and SIGUSR1 are still noticed under a flood
+
+struct bucket {
+    unsigned char addr[16]; // IPv4 address mapped into IPv6, or an IPv6 /64 with the host half zeroed
+    uint32_t stamp; // Milliseconds at the last refill, 0 for an unused slot
+    uint32_t tokens; // Thousandths of a connection
+};
+
+struct admission {
+    long cap; // Most connections open at once
+    long accepted, rejectedCap, rejectedRate; // Counters, printed on SIGUSR1 and at shutdown
+    struct bucket buckets[BUCKETS];
+};
+
+
+struct admission* createAdmission(long fdLimit) {
+    struct admission* adm = calloc(1, sizeof(struct admission));
+    if (adm == NULL) return NULL;
+    // Leave room for the listener, the reactors' epoll sets and stdio
+    adm->cap = (fdLimit - 64 < MAXCONNECTIONS) ? fdLimit - 64 : MAXCONNECTIONS;
+    if (adm->cap < 2) adm->cap = 2;
+    return adm;
+}
+
+void print_admission(struct admission* adm) {
+    printf("admission: %ld open (cap %ld), %ld accepted, %ld rejected over the cap, %ld rejected over the per-address rate\n",
+        atomic_load(&liveConnections), adm->cap, adm->accepted, adm->rejectedCap, adm->rejectedRate);
+    fflush(stdout); // Seen right away even when stdout is a file or pipe
+}
+
+uint32_t now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint32_t ms = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    return ms ? ms : 1;
+}
+
+// Takes a token from the source address's bucket, returns 0 if it has none left
+int bucket_take(struct admission* adm, const struct sockaddr_storage* addr, uint32_t now) {
+    unsigned char key[16];
+    if (addr->ss_family == AF_INET6) {
+        const struct in6_addr* in6 = &((const struct sockaddr_in6*)addr)->sin6_addr;
+        memcpy(key, in6, 16);
+        if (!IN6_IS_ADDR_V4MAPPED(in6)) memset(key + 8, 0, 8);
+    }
+    else {
+        memset(key, 0, 10);
+        key[10] = key[11] = 0xff;
+        memcpy(key + 12, &((const struct sockaddr_in*)addr)->sin_addr, 4);
+    }
+
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    for (int i = 0; i < 16; i++) hash = (hash ^ key[i]) * 1099511628211ULL;
+
+    struct bucket* found = NULL;
+    struct bucket* stalest = NULL;
+    for (int i = 0; i < BUCKET_PROBE; i++) {
+        struct bucket* b = &adm->buckets[(hash + i) & (BUCKETS - 1)];
+        if (b->stamp != 0 && memcmp(b->addr, key, 16) == 0) {
+            found = b;
+            break;
+        }
+        // Unused slots count as the stalest of all
+        if (stalest == NULL || (stalest->stamp != 0 && (b->stamp == 0 || now - b->stamp > now - stalest->stamp))) stalest = b;
+    }
+
+    if (found == NULL) {
+        // A new source gets a full bucket only from an unused slot, one it evicts keeps the tokens refilled below
+        found = stalest;
+        memcpy(found->addr, key, 16);
+        if (found->stamp == 0) {
+            found->stamp = now;
+            found->tokens = BURST_PER_IP * 1000;
+        }
+    }
+    uint64_t tokens = found->tokens + (uint64_t)(now - found->stamp) * RATE_PER_IP;
+    found->tokens = (tokens > BURST_PER_IP * 1000) ? BURST_PER_IP * 1000 : tokens;
+    found->stamp = now;
+
+    if (found->tokens < 1000) return 0;
+    found->tokens -= 1000;
+    return 1;
+}
+
+// Turns a client away: an abortive close, so a flood doesn't leave the server holding sockets in TIME_WAIT
+void reject(int fd) {
+    struct linger linger = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(fd);
+}
+
+// Accepts until the backlog is empty (or ACCEPT_BATCH), every accepted socket is already non-blocking
+void accept_batch(int listener, server* gameServer, struct admission* adm) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char host[HOSTSIZE], port[PORTSIZE];
+    uint32_t now = now_ms();
+
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        addr_len = sizeof(struct sockaddr_storage);
+        int fd = accept4(listener, (struct sockaddr *)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+
+            perror("accept4");
+            if (errno == EMFILE || errno == ENFILE) {
+                // Out of fds, give closing connections a moment instead of spinning on poll
+                struct timespec pause = {0, 10000000};
+                nanosleep(&pause, NULL);
+            }
+            return;
+        }
+
+        if (atomic_load(&liveConnections) >= adm->cap) {
+            adm->rejectedCap++;
+            reject(fd);
+            continue;
+        }
+        if (!bucket_take(adm, &addr, now)) {
+            adm->rejectedRate++;
+            reject(fd);
+            continue;
+        }
+
+        int error = getnameinfo((struct sockaddr *)&addr, addr_len, host, HOSTSIZE, port, PORTSIZE, NI_NUMERICHOST | NI_NUMERICSERV);
+        if (error) {
+            fprintf(stderr, "getnameinfo: %s\n", gai_strerror(error));
+            strcpy(host, "??");
+            strcpy(port, "??");
+        }
+        printf("Connection from %s:%s (fd %d)\n", host, port, fd);
+
+        if (admit_connection(gameServer, fd) < 0) close(fd);
+        else adm->accepted++;
+    }
+}
+
+// Accept loop, runs until active is cleared
+void serve(int listener, server* gameServer, struct admission* adm) {
+    if (fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK) < 0) perror("fcntl");
+
+    struct pollfd pfd;
+    pfd.fd = listener;
+    pfd.events = POLLIN;
+
+    while (active) {
+        if (reportRequested) {
+            reportRequested = 0;
+            print_admission(adm);
+        }
+        // Times out now and then so a thread that signals can't reach still sees active drop
+        if (poll(&pfd, 1, 200) > 0) accept_batch(listener, gameServer, adm);
+    }
+}
+
+// Gives up the open O seat, if any, so the last game can be freed
+void close_game_server(server* gameServer) {
+    if (gameServer->waiting != NULL) game_release(gameServer->waiting);
+    gameServer->waiting = NULL;
+}
+
+// Waits (up to about 5 seconds) for the reactors to bring trackedBytes to target
+int await_tracked(long target) {
+    struct timespec pause = {0, 10000000};
+    for (int i = 0; i < 500 && atomic_load(&trackedBytes) != target; i++) nanosleep(&pause, NULL);
+    return atomic_load(&trackedBytes) == target;
+}
+
+_Static_assert(sizeof(struct connection) + sizeof(struct game) / 2 <= CONN_BUDGET, "an idle connection is over CONN_BUDGET");
+
+// ttts --memtest [connections]: measures what an idle connection costs and checks it against CONN_BUDGET
+// Connections are socketpairs admitted exactly as accepted ones are. Every client then sends half a PLAY, which has to get
+// a receive buffer, and the rest of it, which has to give the buffer back. Closing everything has to free every byte.
+int memtest(long n) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    signal(SIGPIPE, SIG_IGN); // Clients hang up while the server is still telling their opponents
+
+    // Two fds per connection
+    long fdLimit = raise_fd_limit();
+    if (n * 2 + 64 > fdLimit) n = (fdLimit - 64) / 2;
+    if (n < 2) n = 2;
+
+    if (start_reactors(&mask) < 0) return EXIT_FAILURE;
+    server* gameServer = createGameServer();
+    int* clients = malloc(n * sizeof(int));
+    int failed = 0;
+
+    for (long i = 0; i < n; i++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0) {
+            perror("socketpair");
+            n = i;
+            break;
+        }
+        admit_connection(gameServer, sv[0]);
+        clients[i] = sv[1];
+    }
+
+    long idle = atomic_load(&trackedBytes);
+    long perConnection = idle / n;
+
+    for (long i = 0; i < n; i++) write(clients[i], "PLAY|11|Jo", 10);
+    if (!await_tracked(idle + n * FRAMESIZE)) failed = 1;
+    long partial = atomic_load(&trackedBytes);
+
+    // Every player gets a name of their own, so the name table grows and later empties out again
+    char rest[16];
+    for (long i = 0; i < n; i++) write(clients[i], rest, snprintf(rest, sizeof(rest), "%04ld|4x4|", i % 10000));
+    if (!await_tracked(idle)) failed = 1;
+    long played = atomic_load(&trackedBytes);
+    pthread_mutex_lock(&names.lock);
+    size_t playedNames = names.bytes;
+    pthread_mutex_unlock(&names.lock);
+
+    for (long i = 0; i < n; i++) close(clients[i]);
+    stop_reactors();
+    close_game_server(gameServer);
+    free(gameServer);
+    free(clients);
+    long left = atomic_load(&trackedBytes);
+    size_t nameCount = names.count;
+    free_names();
+
+    printf("\nconnections %ld, struct connection %zu bytes, struct game %zu bytes (shared by 2)\n", n, sizeof(struct connection), sizeof(struct game));
+    printf("idle: %ld bytes per connection (budget %d)\n", perConnection, CONN_BUDGET);
+    printf("partial frame pending: %ld bytes per connection\n", (partial - idle) / n + perConnection);
+    printf("after the frame completed: %ld bytes per connection, names %zu bytes in total\n", played / n, playedNames);
+    printf("after closing: %ld bytes still held, %zu names\n", left, nameCount);
+
+    if (failed || perConnection > CONN_BUDGET || played != idle || left != 0 || nameCount != 0) {
+        printf("FAILED\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Method for setting up server sockets
+
+int open_listener(char *service, int queue_size)
+{
+    struct addrinfo hint, *info_list, *info;
+    int error, sock;
+
+    // Initialize hints
+    memset(&hint, 0, sizeof(struct addrinfo));
+    hint.ai_family = AF_UNSPEC;
+    hint.ai_socktype = SOCK_STREAM;
+    hint.ai_flags = AI_PASSIVE;
+
+    // Obtain information for listening socket
+    error = getaddrinfo(NULL, service, &hint, &info_list);
+    if (error) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(error));
+        return -1;
+    }
+
+    // Attempt to create socket
+    for (info = info_list; info != NULL; info = info->ai_next) {
+        sock = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+
+        // If we could not create the socket, try the next method
+        if (sock == -1) continue;
+
+        // Bind socket to requested port
+        error = bind(sock, info->ai_addr, info->ai_addrlen);
+        if (error) {
+            close(sock);
+            continue;
+        }
+        // Enable listening for incoming connection requests
+        error = listen(sock, QUEUE_SIZE);
+        if (error) {
+            close(sock);
+            continue;
+        }
+        // If we got this far, we have opened the socket
+        break;
+    }
+
+    freeaddrinfo(info_list);
+    // Info will be NULL if no method succeeded
+    if (info == NULL) {
+        fprintf(stderr, "Could not bind\n");
+        return -1;
+    }
+
+    return sock;
+}
+
+// ttts --flood [seconds]: connection flood against a server running in this process
+// Established games from 127.0.0.1 keep bouncing draw offers and rejections (two round trips through both players'
+// reactors each time, without ever ending the game) while first nothing else happens and then flood threads connect
+// and hang up from 127.0.0.2 as fast as they can. Each flood thread keeps FLOOD_WINDOW non-blocking connects in flight
+// and gives up on any the kernel hasn't completed within FLOOD_PATIENCE_MS, so a dropped SYN never holds it up.
+// Prints the games' rate and worst round trip for both halves alongside the admission counters, and fails if a game
+// stalls or drops, if the games keep less than FLOOD_KEEP_PERCENT of their calm rate or a round trip is held up for
+// more than FLOOD_WORST_MS, or if none of the flood was turned away.
+#define FLOOD_GAMES 4
+#define FLOOD_WINDOW 64 // Connects each flood thread keeps in flight
+#define FLOOD_PATIENCE_MS 100 // Connects not completed by then are abandoned
+#define FLOOD_KEEP_PERCENT 67 // Games under the flood must keep at least this share of their calm rate...
+#define FLOOD_WORST_MS 250 // ...and never wait longer than this for a reply
+
+struct flood_thread {
+    pthread_t tid;
+    const struct sockaddr_in* server;
+    _Atomic int* running;
+    long attempts, connected, refused, abandoned;
+};
+
+// Connects from the given loopback address, returns the socket or -1
+int flood_connect(const struct sockaddr_in* server, const char* from) {
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    inet_pton(AF_INET, from, &local.sin_addr);
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    int on = 1;
+    setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on)); // Leave picking the port to connect
+    if (bind(sock, (struct sockaddr *)&local, sizeof(local)) < 0 || connect(sock, (struct sockaddr *)server, sizeof(*server)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Starts a non-blocking connect from 127.0.0.2, returns the socket or -1
+int flood_start(const struct sockaddr_in* server) {
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    inet_pton(AF_INET, "127.0.0.2", &local.sin_addr);
+
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sock < 0) return -1;
+    int on = 1;
+    setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+    if (bind(sock, (struct sockaddr *)&local, sizeof(local)) < 0
+        || (connect(sock, (struct sockaddr *)server, sizeof(*server)) < 0 && errno != EINPROGRESS)) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Hangs up with a reset, so the flood doesn't run out of ports to TIME_WAIT
+void flood_reset(int sock) {
+    struct linger linger = {1, 0};
+    setsockopt(sock, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(sock);
+}
+
+void *flood_worker(void *arg) {
+    struct flood_thread* f = arg;
+    struct pollfd pending[FLOOD_WINDOW];
+    uint32_t started[FLOOD_WINDOW];
+    int n = 0;
+
+    while (atomic_load(f->running)) {
+        while (n < FLOOD_WINDOW) {
+            f->attempts++;
+            int sock = flood_start(f->server);
+            if (sock < 0) {
+                f->refused++;
+                break;
+            }
+            pending[n].fd = sock;
+            pending[n].events = POLLOUT;
+            started[n++] = now_ms();
+        }
+
+        poll(pending, n, 10);
+        uint32_t now = now_ms();
+        for (int i = 0; i < n; i++) {
+            if (pending[i].revents == 0 && now - started[i] < FLOOD_PATIENCE_MS) continue;
+
+            int error = 0;
+            socklen_t len = sizeof(error);
+            if (pending[i].revents == 0) f->abandoned++;
+            else if (getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && (error == 0 || error == ECONNRESET)) {
+                f->connected++; // A reset means the server accepted and turned it away before we looked
+            }
+            else f->refused++;
+            flood_reset(pending[i].fd);
+
+            pending[i] = pending[n - 1];
+            started[i--] = started[--n];
+        }
+    }
+
+    for (int i = 0; i < n; i++) flood_reset(pending[i].fd);
+    return NULL;
+}
+
+// Reads from sock until want shows up, returns 0 on timeout or hang up
+int flood_expect(int sock, const char* want) {
+    char buf[BUFSIZE];
+    int len = 0;
+    while (len < BUFSIZE - 1) {
+        int bytes = recv(sock, buf + len, BUFSIZE - 1 - len, 0);
+        if (bytes <= 0) return 0;
+        len += bytes;
+        buf[len] = '\0';
+        if (strstr(buf, want) != NULL) return 1;
+    }
+    return 0;
+}
+
+// Plays draw offer/reject cycles on every game for the given time, returns cycles done or -1 if a game broke
+long flood_play(int players[][2], int seconds, double* worst) {
+    struct timespec start, now, before, after;
+    long cycles = 0;
+    *worst = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        for (int g = 0; g < FLOOD_GAMES; g++) {
+            clock_gettime(CLOCK_MONOTONIC, &before);
+            if (write(players[g][0], "DRAW|2|S|", 9) != 9 || !flood_expect(players[g][1], "DRAW|2|S|")) return -1;
+            if (write(players[g][1], "DRAW|2|R|", 9) != 9 || !flood_expect(players[g][0], "DRAW|2|R|")) return -1;
+            clock_gettime(CLOCK_MONOTONIC, &after);
+
+            double ms = (after.tv_sec - before.tv_sec) * 1e3 + (after.tv_nsec - before.tv_nsec) / 1e6;
+            if (ms > *worst) *worst = ms;
+            cycles++;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (now.tv_sec - start.tv_sec < seconds);
+
+    return cycles;
+}
+
+struct serve_args {
+    int listener;
+    server* gameServer;
+    struct admission* adm;
+};
+
+void *serve_thread(void *arg) {
+    struct serve_args* s = arg;
+    serve(s->listener, s->gameServer, s->adm);
+    return NULL;
+}
+
+int flood(int seconds) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    signal(SIGPIPE, SIG_IGN);
+
+    int listener = open_listener("0", QUEUE_SIZE);
+    if (listener < 0) return EXIT_FAILURE;
+    struct sockaddr_storage bound;
+    socklen_t bound_len = sizeof(bound);
+    getsockname(listener, (struct sockaddr *)&bound, &bound_len);
+
+    struct sockaddr_in target;
+    memset(&target, 0, sizeof(target));
+    target.sin_family = AF_INET;
+    target.sin_port = (bound.ss_family == AF_INET6) ? ((struct sockaddr_in6 *)&bound)->sin6_port : ((struct sockaddr_in *)&bound)->sin_port;
+    inet_pton(AF_INET, "127.0.0.1", &target.sin_addr);
+
+    struct admission* adm = createAdmission(raise_fd_limit());
+    server* gameServer = createGameServer();
+    if (adm == NULL || start_reactors(&mask) < 0) return EXIT_FAILURE;
+    struct serve_args s = {listener, gameServer, adm};
+    pthread_t server_tid;
+    pthread_create(&server_tid, NULL, serve_thread, &s);
+
+    // Set up the established games, X connects first so the pair lands in the same game
+    int players[FLOOD_GAMES][2];
+    memset(players, -1, sizeof(players));
+    struct timeval timeout = {2, 0};
+    int failed = 0;
+    for (int g = 0; g < FLOOD_GAMES && !failed; g++) {
+        for (int side = SIDE_X; side <= SIDE_O; side++) {
+            players[g][side] = flood_connect(&target, "127.0.0.1");
+            if (players[g][side] < 0) {
+                failed = 1;
+                break;
+            }
+            setsockopt(players[g][side], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        }
+        if (failed) break;
+        if (write(players[g][SIDE_X], "PLAY|4|Ann|", 11) != 11 || !flood_expect(players[g][SIDE_X], "WAIT")) failed = 1;
+        if (write(players[g][SIDE_O], "PLAY|4|Bob|", 11) != 11 || !flood_expect(players[g][SIDE_O], "BEGN")) failed = 1;
+        if (!flood_expect(players[g][SIDE_X], "BEGN")) failed = 1;
+    }
+
+    double calmWorst = 0, floodWorst = 0;
+    long calm = failed ? -1 : flood_play(players, seconds, &calmWorst);
+
+    // At least two flood threads even on one core, so the flood isn't paced by a single thread's syscalls
+    int nflood = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nflood < 2) nflood = 2;
+    struct flood_thread* floods = calloc(nflood, sizeof(struct flood_thread));
+    _Atomic int running = 1;
+    for (int i = 0; i < nflood; i++) {
+        floods[i].server = &target;
+        floods[i].running = &running;
+        pthread_create(&floods[i].tid, NULL, flood_worker, &floods[i]);
+    }
+    long flooded = (calm < 0) ? -1 : flood_play(players, seconds, &floodWorst);
+    atomic_store(&running, 0);
+    struct flood_thread f;
+    memset(&f, 0, sizeof(f));
+    for (int i = 0; i < nflood; i++) {
+        pthread_join(floods[i].tid, NULL);
+        f.attempts += floods[i].attempts;
+        f.connected += floods[i].connected;
+        f.refused += floods[i].refused;
+        f.abandoned += floods[i].abandoned;
+    }
+    free(floods);
+
+    active = 0;
+    pthread_join(server_tid, NULL);
+    for (int g = 0; g < FLOOD_GAMES; g++) {
+        if (players[g][SIDE_X] >= 0) close(players[g][SIDE_X]);
+        if (players[g][SIDE_O] >= 0) close(players[g][SIDE_O]);
+    }
+    stop_reactors();
+    close_game_server(gameServer);
+    free(gameServer);
+    free_names();
+    close(listener);
+
+    printf("\n%d established games, %d seconds without and %d seconds with the flood\n", FLOOD_GAMES, seconds, seconds);
+    printf("without flood: %.0f draw cycles/sec, worst round trip %.2f ms\n", calm / (double)seconds, calmWorst);
+    printf("with flood:    %.0f draw cycles/sec, worst round trip %.2f ms\n", flooded / (double)seconds, floodWorst);
+    printf("flood: %d threads, %ld connects (%.0f/sec), %ld completed, %ld refused, %ld abandoned after %d ms\n", nflood,
+        f.attempts, f.attempts / (double)seconds, f.connected, f.refused, f.abandoned, FLOOD_PATIENCE_MS);
+    print_admission(adm);
+
+    int ok = (calm > 0 && flooded > 0 && adm->rejectedRate > 0);
+    if (ok && (flooded * 100 < calm * FLOOD_KEEP_PERCENT || floodWorst > FLOOD_WORST_MS)) {
+        printf("the flood left established games less than %d%% of their calm rate or held a reply up for more than %d ms\n",
+            FLOOD_KEEP_PERCENT, FLOOD_WORST_MS);
+        ok = 0;
+    }
+    free(adm);
+    if (!ok) {
+        printf("FAILED\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char** argv)
+{
+    sigset_t mask;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <port> | --bench [moves] | --selfplay [games] [threads] [variant] | --stress [rounds] [variant] | --memtest [connections] | --flood [seconds]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    init_kernels();
+
+    // Engine benchmark, no sockets involved
+    if (strcmp(argv[1], "--bench") == 0) {
+        long moves = (argc > 2) ? strtol(argv[2], NULL, 10) : 2000000;
+        return bench_variants(moves > 0 ? moves : 2000000);
+    }
+
+    // Bot-vs-bot games on every core, no sockets involved
+    if (strcmp(argv[1], "--selfplay") == 0) {
+        long games = (argc > 2) ? strtol(argv[2], NULL, 10) : 1000000;
+        long threads = (argc > 3) ? strtol(argv[3], NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+        return selfplay(games > 0 ? games : 1000000, threads > 0 ? threads : 1, (argc > 4) ? argv[4] : NULL);
+    }
+
+    // Both sides of one game acting at once
+    if (strcmp(argv[1], "--stress") == 0) {
+        long rounds = (argc > 2) ? strtol(argv[2], NULL, 10) : 100000;
+        return stress(rounds > 0 ? rounds : 100000, (argc > 3) ? argv[3] : NULL);
+    }
+
+    // Memory per connection against CONN_BUDGET
+    if (strcmp(argv[1], "--memtest") == 0) {
+        long connections = (argc > 2) ? strtol(argv[2], NULL, 10) : 4096;
+        return memtest(connections > 0 ? connections : 4096);
+    }
+
+    // Connection flood against established games
+    if (strcmp(argv[1], "--flood") == 0) {
+        long seconds = (argc > 2) ? strtol(argv[2], NULL, 10) : 3;
+        return flood(seconds > 0 ? seconds : 3);
+    }
+
+    char* service = argv[1]; // Port number "service" is the first argument for ttts.c 
+
+    install_handlers(&mask);
+
+    int listener = open_listener(service, QUEUE_SIZE);
+    if (listener < 0) exit(EXIT_FAILURE);
+
+    // Reactor threads serve the connections, this thread only accepts them
+    if (start_reactors(&mask) < 0) exit(EXIT_FAILURE);
+
+    printf("Listening for incoming connections\n");
+
+    server *gameServer = createGameServer();
+
+    struct admission* adm = createAdmission(raise_fd_limit());
+    if (adm == NULL) exit(EXIT_FAILURE);
+    serve(listener, gameServer, adm);
+    print_admission(adm);
+    free(adm);
+
+    // Reactors close every connection on their way out, which frees every game
+    stop_reactors();
+    close_game_server(gameServer);
     free(gameServer);
+    free_names();
     puts("Shutting down");
     close(listener);
 
-    pthread_exit(NULL);
-    
     return EXIT_SUCCESS;
 
 }